@@ -0,0 +1,25 @@
+#!/bin/sh
+# Compare tracer overhead of the ptrace, seccomp-ptrace and seccomp-notify
+# paths on the same tracee.
+#
+# usage: ./bench.sh <tracer> <runs> <tracee> [<tracee args>]
+
+TRACER=$1
+RUNS=$2
+shift 2
+
+run() {
+   start=$(date +%s.%N)
+   i=0
+   while [ $i -lt "$RUNS" ]; do
+      "$@" > /dev/null 2>&1
+      i=$((i + 1))
+   done
+   stop=$(date +%s.%N)
+   echo "$(echo "($stop - $start) / $RUNS" | bc -l) s/run"
+}
+
+printf "native:    "; run "$@"
+printf "ptrace:    "; run "$TRACER" "$@"
+printf "seccomp:   "; run "$TRACER" --seccomp "$@"
+printf "notify:    "; run "$TRACER" --notify "$@"
@@ -3,20 +3,27 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 #include <sys/user.h>
+#include <dirent.h>
 #include <link.h>
 
 #include <time.h>
 
 #include "perf_pt/collect.c"
 #include "perf_pt/decode.c"
+#include "perf_pt/ip_filter.c"
+#include "perf_pt/syscall_filter.c"
+#include "perf_pt/pipeline.c"
+#include "perf_pt/tracee.c"
+#include "perf_pt/supervisor.c"
 
 
 //Compile
-// gcc -L /usr/local/lib/ main.c  -lipt -lxed
+// gcc -L /usr/local/lib/ main.c  -lipt -lxed -lpthread
 
 #define FATAL(...)                             \
    do                                          \
@@ -28,7 +35,9 @@
 
 // Data,Aux,Trace buffer sizes
 #define PERF_PT_DFLT_DATA_BUFSIZE 64
-#define PERF_PT_DFLT_AUX_BUFSIZE 1024
+#define PERF_PT_DFLT_AUX_BUFSIZE 64
+#define PERF_PT_MIN_AUX_BUFSIZE 16
+#define PERF_PT_MAX_AUX_BUFSIZE 1024
 #define PERF_PT_DFLT_INITIAL_TRACE_BUFSIZE 1024 * 1024
 
 #define MAXLIST 100
@@ -38,6 +47,8 @@ char* parsedArgs[MAXLIST];
 struct perf_collector_config pptConf = {
     .data_bufsize = PERF_PT_DFLT_DATA_BUFSIZE,
     .aux_bufsize = PERF_PT_DFLT_AUX_BUFSIZE,
+    .aux_min_bufsize = PERF_PT_MIN_AUX_BUFSIZE,
+    .aux_max_bufsize = PERF_PT_MAX_AUX_BUFSIZE,
     .initial_trace_bufsize = PERF_PT_DFLT_INITIAL_TRACE_BUFSIZE};
 
 void write_memory(void *addr, size_t size, char *filename)
@@ -52,7 +63,8 @@ void write_memory(void *addr, size_t size, char *filename)
 
 void print_help()
 {
-   printf("usage: ./a.out [<Path to Tracee elf file>] [<options>]\n\n");
+   printf("usage: ./a.out [<options>] <Path to Tracee elf file> [<args>]\n");
+   printf("       ./a.out [<options>] --attach <pid>\n\n");
    printf("options:\n\n");
    printf("--depth [numOfInstructions]          preceding number of instructions to check\n");
    printf("--pinfo                              print Intel Pt information\n");
@@ -61,14 +73,230 @@ void print_help()
    printf("--praw                               print raw instructions in buffer.out file\n");
    printf("--psyscall                           print system call chain\n");
    printf("--step                               Step through the syscalls\n");
+   printf("--drain                              drain the AUX buffer while the tracee runs\n");
+   printf("--seccomp                            only stop on security relevant syscalls\n");
+   printf("--syscalls [name,...]                syscalls that stop the tracee (implies --seccomp)\n");
+   printf("--notify                             supervise with seccomp user notifications, no ptrace\n");
+   printf("--async                              only wait for the analysis at barrier syscalls\n");
+   printf("--snapshot                           trace continuously, only decode the tail before a syscall\n");
+   printf("--retcheck                           also check return targets against the call sites\n");
+   printf("--gadgets [n[,size]]                 treat n gadgets of up to size (3) instructions in a row\n");
+   printf("                                     as an attack\n");
+   printf("--entries [n]                        also check indirect call and jump targets against\n");
+   printf("                                     function entries, allowing n misses per syscall\n");
+   printf("--shadow [n]                         also check returns against a shadow call stack,\n");
+   printf("                                     allowing n mismatches per syscall\n");
+   printf("--replay [aux dump]                  time both analyses on a --pbuff dump of the tracee\n");
+   printf("--strict                             treat windows with lost trace as attacks\n");
+   printf("--jobs [n]                           decode large windows on n threads\n");
+   printf("--attach [pid]                       trace a running process and all its threads\n");
+   printf("--filter [exe,lib,...]               only trace the code of these ELF files\n");
+   printf("--aux-budget [KiB]                   largest AUX buffer per thread (default 4096)\n");
+   printf("--ptconfig [profile,knob=value,...]  PT packets, profiles rop (default) and legacy,\n");
+   printf("                                     knobs branch, noretcomp, tsc, mtc, mtc_period,\n");
+   printf("                                     cyc, cyc_thresh, pwr_evt, psb_period\n");
    printf("--ptracetime                         print intel Pt trace time and exit\n");
    printf("--panalysetime                       print analysis time\n\n");
    return;
 }
 
+/*
+ * Decode and analyse the trace produced since the previous check.
+ *
+ * Called with the tracee stopped at a system call. `pid' is the process it
+ * belongs to.
+ *
+ * Returns true if the tracee may continue, or false if it has been killed.
+ */
+bool check_syscall(struct perf_ctx *tracer, struct inst_decoder_ctx *decoder, pid_t traceepid,
+                   pid_t pid)
+{
+   struct user_regs_struct regs;
+
+   /* Gather system call arguments. Any ptrace request also waits until the
+    * tracee is off the CPU, by which time its PT data has reached the AUX
+    * buffer and the AUX head is final. */
+   if (ptrace(PTRACE_GETREGS, traceepid, 0, &regs) == -1)
+   {
+      // Tracee is dead, this is triggered when tracee finish executing
+      if (errno == ESRCH)
+         return true;
+      FATAL("%s", strerror(errno));
+   }
+
+   if (stats.psyscall)
+   {
+      long syscall = regs.orig_rax;
+      /* Print a representation of the system call */
+      fprintf(stderr, "%ld(%ld, %ld, %ld, %ld, %ld, %ld)\n",
+              syscall,
+              (long)regs.rdi, (long)regs.rsi, (long)regs.rdx,
+              (long)regs.r10, (long)regs.r8, (long)regs.r9);
+      if(stats.step){
+          printf("Press any character to continue\n");
+          getchar();
+      }
+   }
+
+   if (stats.pbuff)
+   {
+      write_memory(tracer->aux_buf, tracer->aux_bufsize, "aux");
+      write_memory(tracer->base_buf, tracer->base_bufsize, "base");
+   }
+
+   if (stats.async)
+   {
+      // The image is shared with the windows still queued, so those go
+      // first when the last syscall changed the mappings.
+      if (inst_decoder_stale(decoder))
+      {
+         if (!pipeline_wait(&pipeline, pid))
+         {
+            ptrace(PTRACE_KILL, traceepid, 0, 0);
+            return false;
+         }
+         refresh_inst_decoder(decoder);
+      }
+      // Queue the window and only hold the tracee at barrier syscalls
+      // until everything before it has been analysed.
+      if (!pipeline_submit(&pipeline, tracer, decoder, pid))
+         FATAL("error: queueing trace window");
+      if (is_barrier_syscall(regs.orig_rax, regs.rdx) && !pipeline_wait(&pipeline, pid))
+      {
+         ptrace(PTRACE_KILL, traceepid, 0, 0);
+         return false;
+      }
+   }
+   else if (!check_window(tracer, decoder, &stats))
+   {
+      ptrace(PTRACE_KILL, traceepid, 0, 0);
+      return false;
+   }
+
+   // Read the mappings again once this call may have changed them.
+   watch_mappings(decoder, regs.orig_rax);
+
+   if(stats.step){
+      printf("Press any character to continue\n");
+      getchar();
+   }
+   return true;
+}
+
+/*
+ * Let the thread run to its next stop. Its PT event is never turned off,
+ * windows are delimited by the AUX head alone.
+ */
+void resume_thread(struct tracee_thread *thread, int restart, int sig)
+{
+   if (ptrace(restart, thread->tid, 0, sig) == -1)
+   {
+      // Thread is dead, waitpid will report it.
+      if (errno == ESRCH)
+         return;
+      FATAL("%s", strerror(errno));
+   }
+}
+
+/*
+ * Is `thread', stopped at a syscall, at the syscall's entry?
+ */
+bool syscall_entry_stop(struct tracee_thread *thread)
+{
+   struct __ptrace_syscall_info info;
+
+   // A thread seized inside a syscall reports its exit first, which the
+   // toggle can't tell apart from an entry, so ask the kernel.
+   if (stats.attach &&
+       ptrace(PTRACE_GET_SYSCALL_INFO, thread->tid, sizeof(info), &info) > 0)
+      thread->in_syscall = info.op == PTRACE_SYSCALL_INFO_ENTRY;
+   else
+      thread->in_syscall = !thread->in_syscall;
+   return thread->in_syscall;
+}
+
+/*
+ * Seize thread `tid' and wait until it is stopped.
+ *
+ * Returns true if the thread is stopped, false if it is gone or was
+ * already traced.
+ */
+bool seize_thread(pid_t tid, int options)
+{
+   int wstatus;
+
+   if (ptrace(PTRACE_SEIZE, tid, 0, options) == -1)
+   {
+      // Exited, or auto-attached when a seized thread cloned it.
+      if (errno == ESRCH || errno == EPERM)
+         return false;
+      FATAL("seizing %d: %s", tid, strerror(errno));
+   }
+   if (ptrace(PTRACE_INTERRUPT, tid, 0, 0) == -1)
+      return false;
+
+   for (;;)
+   {
+      if (waitpid(tid, &wstatus, __WALL) == -1 ||
+          WIFEXITED(wstatus) || WIFSIGNALED(wstatus))
+         return false;
+      if ((wstatus >> 16) == PTRACE_EVENT_STOP)
+         return true;
+      // A signal arrived first, deliver it and wait for the interrupt.
+      if (ptrace(PTRACE_CONT, tid, 0, WSTOPSIG(wstatus)) == -1)
+         return false;
+   }
+}
+
+/*
+ * Seize every thread of the running process `pid' and start tracing it.
+ *
+ * Threads spawned by seized threads are attached by the kernel and adopted
+ * when they first stop. Others are caught by scanning /proc/<pid>/task
+ * again until no new thread turns up.
+ *
+ * Returns the number of threads adopted.
+ */
+int attach_process(pid_t pid, int options)
+{
+   char path[64];
+   int adopted = 0, found;
+
+   snprintf(path, sizeof(path), "/proc/%d/task", pid);
+   do
+   {
+      DIR *dir = opendir(path);
+      struct dirent *ent;
+
+      if (dir == NULL)
+         FATAL("attaching to %d: %s", pid, strerror(errno));
+
+      found = 0;
+      while ((ent = readdir(dir)) != NULL)
+      {
+         pid_t tid = atoi(ent->d_name);
+
+         if (tid <= 0 || tracee_find(&tracees, tid) != NULL)
+            continue;
+         if (!seize_thread(tid, options))
+            continue;
+         if (tracee_adopt(&tracees, tid, NULL, &pptConf, false, &stats) == NULL)
+            FATAL("error: tracing thread %d", tid);
+         found++;
+      }
+      closedir(dir);
+      adopted += found;
+   } while (found > 0);
+
+   return adopted;
+}
+
 int main(int argc, char **argv)
 {
    int pArgs=0;
+   const char *syscall_list = NULL;
+   const char *pt_knob_list = NULL;
+   const char *replay_dump = NULL;
    
    clock_t begin;
    clock_t end;
@@ -102,7 +330,7 @@ int main(int argc, char **argv)
          }
          if (strcmp(arg, "--depth") == 0)
          {
-            if (argc <= i) {
+            if (argc <= i + 1) {
             fprintf(stderr,
                "--depth: missing argument.\n");
                return 1;
@@ -111,6 +339,71 @@ int main(int argc, char **argv)
             stats.depth = atoi(argv[++i]);
             continue;
          }
+         if (strcmp(arg, "--retcheck") == 0)
+         {
+            stats.retcheck = true;
+            continue;
+         }
+         if (strcmp(arg, "--gadgets") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--gadgets: missing argument.\n");
+               return 1;
+            }
+            stats.gadget_size = GADGET_SIZE;
+            if (sscanf(argv[++i], "%d,%d", &stats.gadget_chain, &stats.gadget_size) < 1 ||
+                stats.gadget_chain < 1 || stats.gadget_size < 1)
+               FATAL("--gadgets: bad argument %s.", argv[i]);
+            continue;
+         }
+         if (strcmp(arg, "--entries") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--entries: missing argument.\n");
+               return 1;
+            }
+            stats.entries = true;
+            stats.entries_tolerance = atoi(argv[++i]);
+            continue;
+         }
+         if (strcmp(arg, "--shadow") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--shadow: missing argument.\n");
+               return 1;
+            }
+            stats.shadow = true;
+            stats.shadow_tolerance = atoi(argv[++i]);
+            continue;
+         }
+         if (strcmp(arg, "--replay") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--replay: missing argument.\n");
+               return 1;
+            }
+            replay_dump = argv[++i];
+            continue;
+         }
+         if (strcmp(arg, "--jobs") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--jobs: missing argument.\n");
+               return 1;
+            }
+            stats.jobs = atoi(argv[++i]);
+            continue;
+         }
+         if (strcmp(arg, "--strict") == 0)
+         {
+            stats.strict = true;
+            continue;
+         }
          if (strcmp(arg, "--pinfo") == 0)
          {
             stats.pinfo = true;
@@ -141,6 +434,91 @@ int main(int argc, char **argv)
             stats.step = true;
             continue;
          }
+         if (strcmp(arg, "--drain") == 0)
+         {
+            stats.drain = true;
+            continue;
+         }
+         if (strcmp(arg, "--seccomp") == 0)
+         {
+            stats.seccomp = true;
+            continue;
+         }
+         if (strcmp(arg, "--async") == 0)
+         {
+            stats.async = true;
+            continue;
+         }
+         if (strcmp(arg, "--snapshot") == 0)
+         {
+            stats.snapshot = true;
+            continue;
+         }
+         if (strcmp(arg, "--notify") == 0)
+         {
+            stats.notify = true;
+            continue;
+         }
+         if (strcmp(arg, "--attach") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--attach: missing argument.\n");
+               return 1;
+            }
+            stats.attach = atoi(argv[++i]);
+            if (stats.attach <= 0)
+               FATAL("--attach: bad pid: %s", argv[i]);
+            continue;
+         }
+         if (strcmp(arg, "--filter") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--filter: missing argument.\n");
+               return 1;
+            }
+            pptConf.filter = argv[++i];
+            continue;
+         }
+         if (strcmp(arg, "--aux-budget") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--aux-budget: missing argument.\n");
+               return 1;
+            }
+            // The AUX buffer must be a power of 2 pages.
+            size_t pages = atol(argv[++i]) * 1024 / getpagesize();
+            pptConf.aux_max_bufsize = PERF_PT_MIN_AUX_BUFSIZE;
+            while (pptConf.aux_max_bufsize * 2 <= pages)
+               pptConf.aux_max_bufsize *= 2;
+            if (pptConf.aux_bufsize > pptConf.aux_max_bufsize)
+               pptConf.aux_bufsize = pptConf.aux_max_bufsize;
+            continue;
+         }
+         if (strcmp(arg, "--ptconfig") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--ptconfig: missing argument.\n");
+               return 1;
+            }
+            pt_knob_list = argv[++i];
+            continue;
+         }
+         if (strcmp(arg, "--syscalls") == 0)
+         {
+            if (argc <= i + 1) {
+            fprintf(stderr,
+               "--syscalls: missing argument.\n");
+               return 1;
+            }
+            if (!stats.notify)
+               stats.seccomp = true;
+            syscall_list = argv[++i];
+            continue;
+         }
          if (strcmp(arg, "--panalysetime") == 0)
          {
             stats.panalysetime = true;
@@ -154,155 +532,264 @@ int main(int argc, char **argv)
       pArgs=i;
    }
 
-   pid_t traceepid = fork();
+   if (stats.notify)
+      stats.seccomp = false;
 
-   switch (traceepid)
-   {
-   case -1: /* error */
-      FATAL("%s", strerror(errno));
-   case 0: /* child */
-      ptrace(PTRACE_TRACEME, 0, 0, 0);
-      /* Because we're now a tracee, execvp will block until the parent
-       * attaches and allows us to continue. */
-      execvp(argv[pArgs], (argv+pArgs));
-      FATAL("%s", strerror(errno));
-   }
+   if (!parse_pt_knobs(pt_knob_list, &stats.ptknobs))
+      return 1;
 
-   // Wait for tracee to stop
-   waitpid(traceepid, 0, 0);
+   // The snapshot ring is never released, there is nothing to drain or queue.
+   if (stats.snapshot && (stats.drain || stats.async))
+      FATAL("--snapshot can't be combined with --drain or --async");
 
-   ptrace(PTRACE_SETOPTIONS, traceepid, 0, PTRACE_O_TRACEEXIT);
+   // A filter can only be installed by the process itself, before exec.
+   if (stats.attach && (stats.seccomp || stats.notify))
+      FATAL("--attach can't be combined with --seccomp, --syscalls or --notify");
+   if (!stats.attach && pArgs >= argc)
+      FATAL("no tracee given");
 
-   int dec_status;
-   struct pt_insn_decoder *decoder;
-   bool first = true;
+   // Offline: nothing is traced.
+   if (replay_dump != NULL)
+      return bench_dump(replay_dump, argv[pArgs], &stats) ? 0 : 1;
 
-   //
-   struct perf_ctx *tracer = perf_init_collector(&pptConf, traceepid, &stats);
-   if (tracer == NULL)
-      printf("Collector error");
+   if ((stats.seccomp || stats.notify) &&
+       !parse_syscall_set(syscall_list, &traced_syscalls))
+      return 1;
 
-   if (stats.pinfo)
+   // Ptrace-free mode, the tracee is held inside the filtered syscalls.
+   if (stats.notify)
    {
-      printf("perf_fd %d\n", tracer->perf_fd);
+      struct supervisor sv;
+      bool safe;
+
+      if (!supervisor_init(&sv))
+         return 1;
+      if (supervisor_spawn(&sv, argv + pArgs, &pptConf, &stats) == NULL)
+         FATAL("error: starting tracee");
+
+      if(stats.panalysetime){
+         begin=clock();
+      }
+      safe = supervisor_loop(&sv, &stats);
+      if(stats.panalysetime){
+         end=clock();
+         time_spent = (double)(end-begin) / CLOCKS_PER_SEC;
+         printf("%f second\n",time_spent);
+      }
+      supervisor_free(&sv);
+
+      if (safe)
+         printf("No attacks found!\n");
+      return 0;
    }
 
-   if (stats.pinfo)
+   // Nothing traced may run on unchecked once the tracer is gone, e.g. after
+   // it returns on an attack with other processes still traced.
+   int options = PTRACE_O_TRACEEXIT | PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL;
+   // Follow every thread and process the tracee creates, and its execs.
+   int follow = PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                PTRACE_O_TRACEEXEC;
+   pid_t traceepid;
+   struct tracee_thread *thread = NULL;
+   int wstatus;
+
+   if (stats.attach)
+   {
+      traceepid = stats.attach;
+      if (attach_process(traceepid, options | follow) == 0)
+         FATAL("error: attaching to %d", traceepid);
+   }
+   else
    {
-      printf("Aux Buffer size: %ld\n", tracer->aux_bufsize);
-      printf("Base Buffer size: %ld\n", tracer->base_bufsize);
+      traceepid = fork();
+
+      switch (traceepid)
+      {
+      case -1: /* error */
+         FATAL("%s", strerror(errno));
+      case 0: /* child */
+         ptrace(PTRACE_TRACEME, 0, 0, 0);
+         /* Let the parent set its options and open the PT event before the
+          * exec. Seccomp stops must be asked for before the filter exists,
+          * otherwise traced syscalls fail with ENOSYS. */
+         raise(SIGSTOP);
+         if (stats.seccomp &&
+             install_syscall_filter(&traced_syscalls, SECCOMP_RET_TRACE, 0) == -1)
+            FATAL("seccomp: %s", strerror(errno));
+         execvp(argv[pArgs], (argv+pArgs));
+         FATAL("%s", strerror(errno));
+      }
+
+      // Wait for tracee to stop
+      waitpid(traceepid, &wstatus, 0);
+
+      if (stats.seccomp)
+         options |= PTRACE_O_TRACESECCOMP;
+      ptrace(PTRACE_SETOPTIONS, traceepid, 0, options | follow);
+
+      // Tracing starts at the exec, which also rebuilds the decoder image
+      // for the new executable.
+      thread = tracee_adopt(&tracees, traceepid, NULL, &pptConf, true, &stats);
+      if (thread == NULL)
+         FATAL("error: tracing %d", traceepid);
    }
 
+   if (stats.async && !pipeline_start(&pipeline, &stats))
+      FATAL("error: starting decoder thread");
+
    if(stats.panalysetime){
       begin=clock();
    }
 
+   // With a seccomp filter only the traced syscalls stop the tracee, and
+   // they do so once, on entry. Otherwise stop on every syscall entry/exit.
+   int restart = stats.seccomp ? PTRACE_CONT : PTRACE_SYSCALL;
+   int pending_sig = 0;
+   pid_t tid;
+
+   // Every thread we attached to is stopped, checking starts at the next
+   // syscall of each.
+   for (int i = 0; i < tracees.count; i++)
+      resume_thread(tracees.threads[i], restart, 0);
+
    //Main tracing loop
    for (;;)
    {
-      ioctl(tracer->perf_fd, PERF_EVENT_IOC_RESET, 0);
-      ioctl(tracer->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
-
-      /* Enter next system call */
-      if (ptrace(PTRACE_SYSCALL, traceepid, 0, 0) == -1)
+      // Whichever thread stops next.
+      tid = waitpid(-1, &wstatus, __WALL);
+      if (tid == -1)
       {
-         // Tracee is dead, this is triggered when tracee finish executing
-         if (errno == ESRCH)
-            break;
-         FATAL("%s", strerror(errno));
-      }
-
-      if (waitpid(traceepid, 0, 0) == -1)
-      {
-         // Tracee is dead, this is triggered when tracee finish executing
-         if (errno == ESRCH)
+         // No threads left, this is triggered when tracee finish executing
+         if (errno == ECHILD)
             break;
+         if (errno == EINTR)
+            continue;
          FATAL("%s", strerror(errno));
       }
 
-      ioctl(tracer->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+      thread = tracee_find(&tracees, tid);
 
-      if (stats.psyscall)
+      if (WIFEXITED(wstatus) || WIFSIGNALED(wstatus))
       {
-         /* Gather system call arguments */
-         struct user_regs_struct regs;
-         if (ptrace(PTRACE_GETREGS, traceepid, 0, &regs) == -1)
+         if (thread != NULL)
          {
-            // Tracee is dead, this is triggered when tracee finish executing
-            if (errno == ESRCH)
-               break;
-            FATAL("%s", strerror(errno));
-         }
-
-         long syscall = regs.orig_rax;
-         /* Print a representation of the system call */
-         fprintf(stderr, "%ld(%ld, %ld, %ld, %ld, %ld, %ld)\n",
-                 syscall,
-                 (long)regs.rdi, (long)regs.rsi, (long)regs.rdx,
-                 (long)regs.r10, (long)regs.r8, (long)regs.r9);
-         if(stats.step){
-             printf("Press any character to continue\n");
-             getchar();
+            // The pipeline may still be decoding this thread's windows.
+            if (stats.async)
+               pipeline_wait(&pipeline, thread->proc->pid);
+            if (stats.pinfo)
+               perf_print_telemetry(thread->collector, tid);
+            tracee_remove(&tracees, thread);
          }
+         continue;
       }
 
-      if (stats.pbuff)
+      if (thread == NULL)
       {
-         write_memory(tracer->aux_buf, tracer->aux_bufsize, "aux");
-         write_memory(tracer->base_buf, tracer->base_bufsize, "base");
+         // A new task can report its first stop before the clone event.
+         // Its parent isn't known here, so let the worker finish with every
+         // image before one is copied.
+         if (stats.async)
+            pipeline_wait(&pipeline, 0);
+         thread = tracee_adopt(&tracees, tid, NULL, &pptConf, false, &stats);
+         if (thread == NULL)
+            FATAL("error: tracing thread %d", tid);
+         thread->fresh = true;
       }
 
-      if (first)
+      bool check = false;
+      int event = wstatus >> 16;
+      pending_sig = 0;
+      if (WSTOPSIG(wstatus) == (SIGTRAP | 0x80))
+      {
+         // Syscall entry or exit, we only check on entry.
+         check = syscall_entry_stop(thread);
+      }
+      else if (event == PTRACE_EVENT_SECCOMP)
       {
-         first = false;
-         decoder = init_inst_decoder(tracer->aux_buf, tracer->aux_bufsize, &dec_status, argv[pArgs], &stats);
-         if (decoder == NULL)
-            printf("error: decoder initialization\n");
+         check = true;
       }
-      else
+      else if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK ||
+               event == PTRACE_EVENT_VFORK)
       {
-         int dec_status = pt_insn_sync_set(decoder, 0);
-         if (dec_status == -pte_eos)
+         // Open the new task's PT event before it runs any code.
+         unsigned long new_tid;
+         if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &new_tid) == -1)
+            FATAL("%s", strerror(errno));
+         // A forked child copies its parent's image, which the worker may
+         // still be changing and which lacks the mappings of queued windows.
+         // If those showed an attack, the child goes with its parent.
+         if (stats.async && !pipeline_wait(&pipeline, thread->proc->pid))
+            kill(new_tid, SIGKILL);
+         else if (tracee_find(&tracees, new_tid) == NULL)
          {
-            // There were no blocks in the stream. The user will find out on next
-            // call to hwt_ipt_next_block().
-            printf("no blocks\n");
+            struct tracee_thread *new_thread =
+                tracee_adopt(&tracees, new_tid, thread, &pptConf, false, &stats);
+            if (new_thread == NULL)
+               FATAL("error: tracing task %lu", new_tid);
+            new_thread->fresh = true;
          }
-         else if (dec_status < 0)
+      }
+      else if (event == PTRACE_EVENT_EXEC)
+      {
+         // New image, rebuild the process' decoder from the new executable.
+         unsigned long former_tid;
+         if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &former_tid) == -1)
+            FATAL("%s", strerror(errno));
+         // Windows of the old image must be done before it is freed. If
+         // they showed an attack the process is dying, leave it be.
+         if (stats.async && !pipeline_wait(&pipeline, thread->proc->pid))
+            continue;
+         if (!tracee_exec(&tracees, thread, former_tid, &pptConf, &stats))
+            FATAL("error: rebuilding image of %d", tid);
+         thread = tracee_find(&tracees, tid);
+      }
+      else if (event == PTRACE_EVENT_STOP)
+      {
+         int sig = WSTOPSIG(wstatus);
+         thread->fresh = false;
+         if (sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU)
          {
-            printf("sync error\n");
+            // Group-stop of a seized process, stay stopped until SIGCONT.
+            resume_thread(thread, PTRACE_LISTEN, 0);
+            continue;
          }
+         // Otherwise the initial stop of a task spawned by a seized thread.
       }
-
-      if (!decode_trace(decoder, &dec_status, &stats))
-         {
-            ptrace(PTRACE_KILL, traceepid, 0, 0);
-            return 0;
-         } 
-      if(stats.step){
-         printf("Press any character to continue\n");
-         getchar();
+      else if (event == 0 && WSTOPSIG(wstatus) == SIGSTOP && thread->fresh)
+      {
+         // Initial stop of a new thread, don't deliver it.
+         thread->fresh = false;
       }
-      
-
-      /* Run system call and stop on exit */
-      if (ptrace(PTRACE_SYSCALL, traceepid, 0, 0) == -1)
+      else if (event == 0 && WSTOPSIG(wstatus) != SIGTRAP)
       {
-         // Tracee is dead, this is triggered when tracee finish executing
-         if (errno == ESRCH)
-            break;
-         FATAL("%s", strerror(errno));
+         // Signal delivery stop, pass the signal on.
+         pending_sig = WSTOPSIG(wstatus);
       }
-      if (waitpid(traceepid, 0, 0) == -1)
+
+      if (check && !check_syscall(thread->collector, thread->decoder, tid,
+                                  thread->proc->pid))
       {
-         // Tracee is dead, this is triggered when tracee finish executing
-         if (errno == ESRCH)
-            break;
-         FATAL("%s", strerror(errno));
+         // In async mode only the process the attack was found in is
+         // killed, its threads are reaped as they exit and the others are
+         // still checked.
+         if (!stats.async)
+            return 0;
+         continue;
       }
 
+      resume_thread(thread, restart, pending_sig);
+
    } // End loop
 
+   if (stats.async)
+   {
+      // Trace left after the last barrier still gets its verdict.
+      bool safe = pipeline_wait(&pipeline, 0);
+      pipeline_stop(&pipeline);
+      if (!safe)
+         return 0;
+   }
+
 
    if(stats.panalysetime){
       end=clock();
@@ -313,8 +800,5 @@ int main(int argc, char **argv)
 
    printf("No attacks found!\n");
 
-   free_insn_decoder(decoder);
-
-   if (!perf_free_collector(tracer))
-      printf("error: Freeing Tracer\n");
+   tracee_free_all(&tracees);
 }
@@ -1,34 +1,321 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <intel-pt.h>
 #include <stdbool.h>
 
-bool exec_flow_analysis(struct pt_insn *execInstArr, int instCnt)
+// Open calls remembered per thread, and the longest call instruction.
+#define FLOW_RAS_SIZE 64
+#define MAX_CALL_SIZE 15
+
+// Longest gadget, in instructions, unless --gadgets says otherwise.
+#define GADGET_SIZE 3
+
+// Control transfers kept per thread without --depth, and allocated at first.
+#define FLOW_RING_DEFAULT (1 << 12)
+#define FLOW_RING_MIN 64
+
+/*
+ * One control transfer in the decoded trace: all the analysis needs to know
+ * about the instructions executed.
+ */
+struct flow_entry
+{
+    uint64_t ip;     // Address of the branch instruction.
+    uint64_t target; // For returns, where it went, or 0 if not decoded yet.
+    uint32_t insn;   // Instructions executed in the window up to and including it.
+    uint8_t iclass;  // Its enum pt_insn_class.
+    uint8_t ret;     // For returns, their enum flow_ret.
+    bool indirect;   // Through a register or memory? For near calls and
+                     // jumps, only known with --entries or --gadgets.
+};
+
+/*
+ * Analysis state of a thread, carried from one window to the next: a shadow
+ * of its call stack, kept up to date as calls and returns are decoded, with
+ * the calls made in earlier windows at the bottom.
+ */
+struct flow_state
+{
+    uint64_t ras[FLOW_RAS_SIZE]; // Call sites of the open calls, a ring.
+    int ras_top;                 // Slot of the next call.
+    int ras_depth;               // Open calls remembered, oldest dropped first.
+    int ras_carried;             // How many of them predate this window.
+    int mismatches;              // Returns to no open call in this window.
+    int stray_targets;           // Indirect branches to no function entry.
+    int gadgets;                 // Gadgets run in a row so far.
+    int longest_chain;           // Most of them in a row in this window.
+    uint64_t last_ip;            // Last branch decoded.
+    bool ret_pending;            // Was it a return? Its target starts the next
+                                 // window.
+};
+
+/*
+ * The latest control transfers of a thread's window, oldest first.
+ *
+ * With --depth, only the branches among the last `depth' instructions are
+ * looked at, and there can't be more of them than instructions. Older ones
+ * fall out of the ring; the shadow stack has seen them already. The ring
+ * starts small and only grows as far as a window fills it.
+ */
+struct flow_ring
+{
+    struct flow_entry *entry; // `mask + 1' slots, a power of two.
+    uint32_t mask;
+    uint32_t limit;           // Slots it may grow to, a power of two.
+    uint32_t next;            // Slot of the next entry, modulo the size.
+    uint32_t count;           // Entries held.
+    bool grow;                // Keep every entry, growing as needed, rather
+                              // than retiring the oldest.
+};
+
+enum flow_ret
+{
+    FLOW_RET_PENDING,   // Target not decoded yet.
+    FLOW_RET_UNMATCHED, // Returns to no open call.
+    FLOW_RET_WINDOW,    // Returns from a call made in this window.
+    FLOW_RET_CARRIED,   // Returns from a call made before this window.
+};
+
+static void flow_ras_push(struct flow_state *state, uint64_t site)
+{
+    state->ras[state->ras_top] = site;
+    state->ras_top = (state->ras_top + 1) % FLOW_RAS_SIZE;
+    if (state->ras_depth < FLOW_RAS_SIZE)
+        state->ras_depth++;
+    else if (state->ras_carried > 0)
+        state->ras_carried--;
+}
+
+/*
+ * Close the innermost open call that `target' returns from, along with any
+ * calls above it that were unwound without returning (longjmp, exceptions).
+ */
+static enum flow_ret flow_ras_pop(struct flow_state *state, uint64_t target)
+{
+    for (int depth = state->ras_depth; depth > 0; depth--)
+    {
+        uint64_t site = state->ras[(state->ras_top - state->ras_depth + depth - 1 +
+                                    FLOW_RAS_SIZE) % FLOW_RAS_SIZE];
+        if (target <= site || target - site > MAX_CALL_SIZE)
+            continue;
+
+        state->ras_top = (state->ras_top - state->ras_depth + depth - 1 +
+                          FLOW_RAS_SIZE) % FLOW_RAS_SIZE;
+        state->ras_depth = depth - 1;
+        if (state->ras_depth < state->ras_carried)
+        {
+            state->ras_carried = state->ras_depth;
+            return FLOW_RET_CARRIED;
+        }
+        return FLOW_RET_WINDOW;
+    }
+    return FLOW_RET_UNMATCHED;
+}
+
+/*
+ * Check the return at `ip' to `target' against the shadow stack of the
+ * thread, as soon as it is decoded.
+ *
+ * A return to an older open call unwinds the ones above it, as longjmp(3)
+ * and exceptions do. A return to no open call at all is a mismatch, unless
+ * the shadow stack is empty: the call may have been made before tracing, or
+ * dropped for depth.
+ *
+ * Returns what the return matched.
+ */
+static enum flow_ret flow_return(struct flow_state *state, uint64_t ip, uint64_t target)
+{
+    enum flow_ret ret = flow_ras_pop(state, target);
+
+    if (ret == FLOW_RET_UNMATCHED && state->ras_depth > 0)
+    {
+        state->mismatches++;
+        if (stats.pinfo)
+            printf("return 0x%" PRIx64 " to 0x%" PRIx64 " matches no call\n", ip,
+                   target);
+    }
+    return ret;
+}
+
+/*
+ * Returns how `entry' moves the call/return balance of the window.
+ */
+static int flow_balance(const struct flow_entry *entry)
+{
+    switch (entry->iclass)
+    {
+    case ptic_call: // Near (function) call
+        return -1;
+    case ptic_return: // Near (function) return
+        // A return from a call before the window balances a call the
+        // window never saw.
+        return entry->ret == FLOW_RET_CARRIED ? 0 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Could the `len' instructions up to and including `entry' be a gadget: a
+ * short sequence that ends in a return to no open call, or in an indirect
+ * jump?
+ */
+static bool flow_gadget(const struct flow_entry *entry, uint32_t len)
+{
+    if (len > (uint32_t)stats.gadget_size)
+        return false;
+
+    switch (entry->iclass)
+    {
+    case ptic_return:
+        return entry->ret == FLOW_RET_PENDING || entry->ret == FLOW_RET_UNMATCHED;
+    case ptic_jump:
+    case ptic_indirect:
+    case ptic_far_jump:
+        return entry->indirect;
+    }
+    return false;
+}
+
+/*
+ * Allocate a ring that holds up to at least `size' entries, with room for
+ * FLOW_RING_MIN at first.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool flow_ring_init(struct flow_ring *ring, uint32_t size)
+{
+    uint32_t slots = FLOW_RING_MIN;
+    while (slots < size && slots < (1u << 31))
+        slots <<= 1;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->entry = malloc(FLOW_RING_MIN * sizeof(*ring->entry));
+    if (ring->entry == NULL)
+    {
+        printf("Error: allocating flow ring");
+        return false;
+    }
+    ring->mask = FLOW_RING_MIN - 1;
+    ring->limit = slots;
+    return true;
+}
+
+static void flow_ring_free(struct flow_ring *ring)
+{
+    free(ring->entry);
+    ring->entry = NULL;
+}
+
+/*
+ * Empty the ring for a new window of the thread `state' belongs to.
+ */
+static void flow_ring_start(struct flow_ring *ring, struct flow_state *state)
+{
+    ring->next = 0;
+    ring->count = 0;
+    // Calls still open from earlier windows.
+    state->ras_carried = state->ras_depth;
+    state->mismatches = 0;
+    state->stray_targets = 0;
+    // A chain may have started before the window.
+    state->longest_chain = state->gadgets;
+}
+
+// The `i'-th oldest entry.
+static inline struct flow_entry *flow_ring_at(struct flow_ring *ring, uint32_t i)
+{
+    return &ring->entry[(ring->next - ring->count + i) & ring->mask];
+}
+
+/*
+ * Make room for a new entry, dropping the oldest if full.
+ *
+ * Returns the entry to fill in, or NULL if a growing ring is out of memory.
+ */
+static struct flow_entry *flow_ring_push(struct flow_ring *ring)
+{
+    if (ring->count > ring->mask)
+    {
+        struct flow_entry *entry = NULL;
+        uint32_t slots = (ring->mask + 1) * 2;
+
+        // Not retired from yet, so not wrapped either.
+        if (ring->grow || ring->mask < ring->limit - 1)
+        {
+            entry = realloc(ring->entry, slots * sizeof(*entry));
+            if (entry == NULL)
+                printf("Error: growing flow ring");
+        }
+
+        if (entry != NULL)
+        {
+            ring->entry = entry;
+            ring->mask = slots - 1;
+        }
+        else if (ring->grow)
+        {
+            return NULL;
+        }
+        else
+        {
+            // Make do with what it has.
+            ring->limit = ring->mask + 1;
+            ring->count--;
+        }
+    }
+    ring->count++;
+    return &ring->entry[ring->next++ & ring->mask];
+}
+
+bool exec_flow_analysis(struct flow_ring *ring, uint32_t instCnt,
+                        struct flow_state *state)
 {
 
     int cnt = 1;
-    int stop= -1;
 
-    if(stats.limited && stats.depth<instCnt){
-        stop = instCnt-stats.depth-1;
+    // Only the branches among the last `depth' instructions count.
+    uint32_t first = 0;
+    if(stats.limited && (uint32_t)stats.depth<instCnt){
+        first = instCnt-stats.depth;
     }
 
-    for (int i= instCnt - 1;i >stop; i--)
+    // Instructions run up to the previous branch.
+    uint32_t prev = 0;
+
+    for (uint32_t i = 0; i < ring->count; i++)
     {
-        switch (execInstArr[i].iclass)
+        struct flow_entry *entry = flow_ring_at(ring, i);
+
+        if (entry->insn > first)
+            cnt += flow_balance(entry);
+
+        // Gadgets chained by their returns and jumps.
+        if (stats.gadget_chain > 0)
         {
-        case ptic_call: // Near (function) call
-            cnt--;
-            break;
-        case ptic_return: // Near (function) return
-            cnt++;
-            break;
+            if (!flow_gadget(entry, entry->insn - prev))
+                state->gadgets = 0;
+            else if (++state->gadgets > state->longest_chain)
+                state->longest_chain = state->gadgets;
         }
+        prev = entry->insn;
     }
+    if (ring->count > 0)
+    {
+        struct flow_entry *last = flow_ring_at(ring, ring->count - 1);
+
+        // The window ended on a return, its target starts the next one.
+        state->last_ip = last->ip;
+        state->ret_pending = last->iclass == ptic_return && last->target == 0;
+    }
+
     //printf("Call/Ret Ibalance\n%d\n",cnt);
     if(cnt<10)
         return true;
 
     return false;
-}
\ No newline at end of file
+}
@@ -2,16 +2,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <syscall.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <time.h>
+#include <stdatomic.h>
 #include <intel-pt.h>
 #include <linux/perf_event.h>
 
+#include "pt_knobs.c"
+
 #define SYSFS_PT_TYPE "/sys/bus/event_source/devices/intel_pt/type"
 #define MAX_PT_TYPE_STR 8
 
@@ -20,10 +28,71 @@
 
 #define AUX_BUF_WAKE_RATIO 0.5
 
+// Grow the AUX buffer when a window fills more than this share of it.
+#define AUX_GROW_RATIO 0.75
+// Shrink it after this many windows in a row used less than AUX_IDLE_RATIO.
+#define AUX_SHRINK_WINDOWS 256
+#define AUX_IDLE_RATIO 0.125
+
+// A PSB packet is this pair of bytes, repeated to fill PSB_SIZE.
+#define PSB_BYTE_0 0x02
+#define PSB_BYTE_1 0x82
+#define PSB_SIZE 16
+
 #ifndef INFTIM
 #define INFTIM -1
 #endif
 
+#ifndef PERF_AUX_FLAG_PARTIAL
+#define PERF_AUX_FLAG_PARTIAL 0x04
+#endif
+#ifndef PERF_AUX_FLAG_COLLISION
+#define PERF_AUX_FLAG_COLLISION 0x08
+#endif
+
+/*
+ * Storage for a trace drained out of the AUX buffer.
+ */
+struct perf_trace
+{
+    void *buf;      // Linear copy of the drained trace.
+    __u64 len;      // Bytes of trace in `buf'.
+    __u64 capacity; // Allocated size of `buf'.
+};
+
+/*
+ * An executable mapping reported by PERF_RECORD_MMAP2, to be added to the
+ * decoder image.
+ */
+struct perf_mmap
+{
+    __u64 addr;              // Start address.
+    __u64 len;               // Length in bytes.
+    __u64 pgoff;             // File offset of `addr'.
+    struct perf_mmap *next;  // Next mapping, in the order they were made.
+    char filename[];
+};
+
+/*
+ * How much trace a collector sees, and how often it overflowed.
+ */
+struct perf_telemetry
+{
+    __u64 windows;        // Windows handed out.
+    __u64 bytes;          // Trace produced, in bytes.
+    __u64 max_window;     // Most trace produced between two windows.
+    __u64 truncated;      // PERF_RECORD_AUX with PERF_AUX_FLAG_TRUNCATED.
+    __u64 partial;        // PERF_RECORD_AUX with PERF_AUX_FLAG_PARTIAL.
+    __u64 collisions;     // PERF_RECORD_AUX with PERF_AUX_FLAG_COLLISION.
+    __u64 lost;           // Records lost, as reported by PERF_RECORD_LOST.
+    __u64 mmaps;          // PERF_RECORD_MMAP2 of executable mappings.
+    __u64 resizes;        // Times the AUX buffer was remapped.
+    __u64 aux_seen;       // AUX head at the last window.
+    __u64 last_window;    // Trace produced for the last window.
+    __u64 truncated_seen; // `truncated' at the last resize check.
+    int idle_windows;     // Windows in a row below AUX_IDLE_RATIO.
+};
+
 /*
  * Stores all information about the collector.
  */
@@ -34,6 +103,31 @@ struct perf_ctx
     size_t aux_bufsize;  // The size of the AUX buffer's mmap(2).
     void *base_buf;      // Ptr to the start of the base buffer.
     size_t base_bufsize; // The size the base buffer's mmap(2).
+    __u64 aux_last;      // Monotonic AUX offset of the next window's start.
+    void *wrap_buf;      // Linear copy of a window that wraps the AUX ring.
+    bool draining;                 // Is the drain thread running?
+    bool snapshot;                 // Overwrite mode, AUX mapped read-only.
+    pthread_t collector_thread;    // Drain thread handle.
+    int stop_fds[2];               // Pipe used to stop the poll loop.
+    pthread_mutex_t trace_lock;    // Guards `trace' and the AUX tail.
+    struct perf_trace trace;       // Trace drained by the collector thread.
+    void *data_tmp;                // Records copied out of the data buffer.
+    struct perf_mmap *mmaps;       // Mappings read since the last window, and
+    struct perf_mmap **mmaps_tail; // where to append the next one.
+    struct perf_mmap *window_mmaps; // Mappings up to the current window, for
+                                    // the decoder to take.
+    bool verbose;                  // Print task records, for --pinfo.
+    size_t aux_min_bufsize;        // Bounds for resizing the AUX buffer,
+    size_t aux_max_bufsize;        // in bytes.
+    bool window_lost;              // Did the event overflow before the end of
+                                   // the current window?
+    __u64 truncated_resumed;       // `telemetry.truncated' when the event was
+                                   // last turned back on.
+    bool tail_dropped;             // Did a resize drop trace kept in the ring?
+                                   // Cleared by the consumer.
+    __u64 snapshot_from;           // Offset in the snapshot window from which
+                                   // it has been copied into `wrap_buf'.
+    struct perf_telemetry telemetry;
 };
 
 struct stats_config
@@ -46,7 +140,23 @@ struct stats_config
     bool step;
     bool limited;
     bool panalysetime;
+    bool drain;
+    bool seccomp;
+    bool notify;
+    bool async;
+    bool snapshot;
+    bool strict;
+    bool retcheck;
+    bool shadow;
+    int shadow_tolerance;    // Returns to no open call let through per window.
+    int gadget_chain;        // Gadgets in a row that make an attack, 0 for off.
+    int gadget_size;         // Longest gadget, in instructions.
+    bool entries;
+    int entries_tolerance;   // Indirect branches to no function let through.
     int depth;
+    int jobs;                // Threads decoding one big window, 0 for one.
+    pid_t attach;
+    struct pt_knobs ptknobs;
 } stats;
 
 struct perf_collector_config
@@ -55,22 +165,652 @@ struct perf_collector_config
     size_t aux_bufsize;           // AUX buf size (in pages).
     size_t initial_trace_bufsize; // Initial capacity (in bytes) of a
                                   // trace storage buffer.
+    const char *filter;           // Objects to trace, see apply_ip_filter().
+                                  // NULL traces all user-space code.
+    size_t aux_min_bufsize;       // The AUX buf is resized within these
+    size_t aux_max_bufsize;       // bounds (in pages), powers of 2.
+};
+
+// A data buffer sample indicating that new data is available in the AUX
+// buffer. This struct is not defined in a perf header, so we have to define it
+// ourselves.
+struct perf_record_aux_sample
+{
+    struct perf_event_header header;
+    __u64 aux_offset;
+    __u64 aux_size;
+    __u64 flags;
+    // ...
+    // More variable-sized data follows, but we don't use it.
+};
+
+// The rest of the sideband records we read, see perf_event_open(2). No
+// sample_id_all, so nothing follows them.
+struct perf_record_mmap2
+{
+    struct perf_event_header header;
+    __u32 pid, tid;
+    __u64 addr;
+    __u64 len;
+    __u64 pgoff;
+    __u8 id[24]; // maj, min, ino, ino_generation or a build id.
+    __u32 prot, flags;
+    char filename[];
+};
+
+struct perf_record_lost
+{
+    struct perf_event_header header;
+    __u64 id;
+    __u64 lost;
+};
+
+struct perf_record_comm
+{
+    struct perf_event_header header;
+    __u32 pid, tid;
+    char comm[];
+};
+
+struct perf_record_task
+{
+    struct perf_event_header header;
+    __u32 pid, ppid;
+    __u32 tid, ptid;
+    __u64 time;
+};
+
+struct perf_record_itrace_start
+{
+    struct perf_event_header header;
+    __u32 pid, tid;
+};
+
+// The format of the data returned by read(2) on a Perf file descriptor.
+// Note that the size of this will change if you change the Perf `read_format`
+// config field (more fields become available).
+struct read_format
+{
+    __u64 value;
 };
 
 // Private prototypes.
-static int open_perf(size_t, pid_t traceepid, struct stats_config *);
+static bool handle_sample(struct perf_ctx *, void *, bool);
+static bool queue_mmap(struct perf_ctx *, struct perf_record_mmap2 *);
+static bool map_aux(struct perf_ctx *, size_t);
+static void adapt_aux_size(struct perf_ctx *);
+static bool read_aux(struct perf_ctx *);
+static bool poll_loop(struct perf_ctx *);
+static void *collector_thread(void *);
+static bool start_drain(struct perf_ctx *);
+static bool stop_drain(struct perf_ctx *);
+static void resume_event(struct perf_ctx *);
+static bool snapshot_psb_at(struct perf_ctx *, __u64);
+static int open_perf(size_t aux_watermark, pid_t traceepid, bool, struct stats_config *);
 
 // Exposed Prototypes.
-struct perf_ctx *perf_init_collector(struct perf_collector_config *, pid_t traceepid, struct stats_config *);
+struct perf_ctx *perf_init_collector(struct perf_collector_config *, pid_t traceepid,
+                                     bool at_exec, struct stats_config *);
+bool perf_next_window(struct perf_ctx *tr_ctx, void **window, size_t *len);
+void perf_release_window(struct perf_ctx *tr_ctx, size_t consumed);
+bool perf_snapshot_psb(struct perf_ctx *tr_ctx, uint64_t before, uint64_t *psb);
+void perf_snapshot_fill(struct perf_ctx *tr_ctx, uint64_t from);
 bool perf_free_collector(struct perf_ctx *tr_ctx);
+void perf_print_telemetry(struct perf_ctx *tr_ctx, pid_t tid);
+void perf_free_mmaps(struct perf_mmap *);
 
 /*
- * Opens the perf file descriptor and returns it.
+ * Remember the executable mapping in `rec' for the decoder image.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+queue_mmap(struct perf_ctx *tr_ctx, struct perf_record_mmap2 *rec)
+{
+    size_t name_len = strnlen(rec->filename, (void *)rec + rec->header.size -
+                                                 (void *)rec->filename);
+    struct perf_mmap *map = malloc(sizeof(*map) + name_len + 1);
+    if (map == NULL)
+    {
+        printf("Error: allocating mapping");
+        return false;
+    }
+    map->addr = rec->addr;
+    map->len = rec->len;
+    map->pgoff = rec->pgoff;
+    map->next = NULL;
+    memcpy(map->filename, rec->filename, name_len);
+    map->filename[name_len] = '\0';
+
+    *tr_ctx->mmaps_tail = map;
+    tr_ctx->mmaps_tail = &map->next;
+    tr_ctx->telemetry.mmaps++;
+    return true;
+}
+
+/*
+ * Read the new records from the Perf data buffer: count overflows, queue
+ * new executable mappings and, with --pinfo, log task records.
+ *
+ * Called by the poll(2) loop when woken up with a POLL_IN, with `drain' set
+ * so new AUX data is copied out for each PERF_RECORD_AUX, and for every
+ * window otherwise.
+ *
+ * Returns true on success, or false otherwise.
+ */
+static bool
+handle_sample(struct perf_ctx *tr_ctx, void *data_tmp, bool drain)
+{
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+
+    // We need to use atomics with orderings to protect against 2 cases.
+    //
+    // 1) It must not be possible to read the data buffer before the most
+    //    recent head is obtained. This would mean that we may read nothing when
+    //    there is really data available.
+    //
+    // 2) We must ensure that we have already copied out of the data buffer
+    //    before we update the tail. Failure to do so would allow the kernel to
+    //    re-use the space we have just "marked free" before we copied it.
+    //
+    // The initial load of the tail is relaxed since we are the only thread
+    // mutating it and we don't mind variations on the ordering.
+    //
+    // See the following comment in the Linux kernel sources for more:
+    // https://github.com/torvalds/linux/blob/3be4aaf4e2d3eb95cce7835e8df797ae65ae5ac1/kernel/events/ring_buffer.c#L60-L85
+    //
+    // With `drain' both the drain thread and perf_next_window() read the
+    // ring, and share the counters, the mapping queue and the trace.
+    if (drain)
+        pthread_mutex_lock(&tr_ctx->trace_lock);
+
+    void *data = (void *)hdr + hdr->data_offset;
+    __u64 head_monotonic =
+        atomic_load_explicit((_Atomic __u64 *)&hdr->data_head,
+                             memory_order_acquire);
+    __u64 tail_monotonic =
+        atomic_load_explicit((_Atomic __u64 *)&hdr->data_tail,
+                             memory_order_relaxed);
+    __u64 size = hdr->data_size;        // No atomic load. Constant value.
+    __u64 head = head_monotonic % size; // Head must be manually wrapped.
+    __u64 tail = tail_monotonic % size;
+    // Compare the monotonic values, a full ring has head == tail otherwise.
+    __u64 new_data_size = head_monotonic - tail_monotonic;
+
+    // Copy samples out, removing wrap in the process.
+    if (tail + new_data_size <= size)
+    {
+        // Not wrapped.
+        memcpy(data_tmp, data + tail, new_data_size);
+    }
+    else
+    {
+        // Wrapped.
+        memcpy(data_tmp, data + tail, size - tail);
+        memcpy(data_tmp + size - tail, data, head);
+    }
+    void *data_tmp_end = data_tmp + new_data_size;
+    atomic_store_explicit((_Atomic __u64 *)&hdr->data_tail, head_monotonic,
+                          memory_order_release);
+
+    bool ret = true;
+    void *next_sample = data_tmp;
+    while (ret && next_sample + sizeof(struct perf_event_header) <= data_tmp_end)
+    {
+        struct perf_event_header *sample_hdr = next_sample;
+        struct perf_record_aux_sample *rec_aux_sample;
+        struct perf_record_mmap2 *rec_mmap;
+        struct perf_record_comm *rec_comm;
+        struct perf_record_task *rec_task;
+        struct perf_record_itrace_start *rec_start;
+
+        if (sample_hdr->size == 0 || next_sample + sample_hdr->size > data_tmp_end)
+        {
+            printf("Error: malformed perf record\n");
+            break;
+        }
+
+        switch (sample_hdr->type)
+        {
+        case PERF_RECORD_AUX:
+            // Data was written to the AUX buffer.
+            rec_aux_sample = next_sample;
+            // If the data written into the AUX buffer was truncated we
+            // didn't drain it quickly enough, and the kernel turned the
+            // event off. The window is reported as having lost trace, the
+            // event is turned back on when it is released, and the next
+            // window grows the buffer.
+            if (rec_aux_sample->flags & PERF_AUX_FLAG_TRUNCATED)
+                tr_ctx->telemetry.truncated++;
+            if (rec_aux_sample->flags & PERF_AUX_FLAG_PARTIAL)
+                tr_ctx->telemetry.partial++;
+            if (rec_aux_sample->flags & PERF_AUX_FLAG_COLLISION)
+                tr_ctx->telemetry.collisions++;
+            if (drain)
+                ret = read_aux(tr_ctx);
+            break;
+        case PERF_RECORD_LOST:
+            tr_ctx->telemetry.lost += ((struct perf_record_lost *)next_sample)->lost;
+            break;
+        case PERF_RECORD_MMAP2:
+            // Only executable mappings are reported, see open_perf().
+            rec_mmap = next_sample;
+            if (rec_mmap->filename[0] == '/')
+                ret = queue_mmap(tr_ctx, rec_mmap);
+            break;
+        case PERF_RECORD_COMM:
+            rec_comm = next_sample;
+            if (tr_ctx->verbose)
+                printf("pid %u tid %u comm %s%s\n", rec_comm->pid, rec_comm->tid,
+                       rec_comm->comm,
+                       sample_hdr->misc & PERF_RECORD_MISC_COMM_EXEC ? " (exec)" : "");
+            break;
+        case PERF_RECORD_EXIT:
+            rec_task = next_sample;
+            if (tr_ctx->verbose)
+                printf("pid %u tid %u exit\n", rec_task->pid, rec_task->tid);
+            break;
+        case PERF_RECORD_ITRACE_START:
+            rec_start = next_sample;
+            if (tr_ctx->verbose)
+                printf("pid %u tid %u trace start\n", rec_start->pid, rec_start->tid);
+            break;
+        }
+        next_sample += sample_hdr->size;
+    }
+
+    if (drain)
+        pthread_mutex_unlock(&tr_ctx->trace_lock);
+    return ret;
+}
+
+/*
+ * Read data out of the AUX buffer, appending it to `tr_ctx->trace'.
+ *
+ * The caller must hold `tr_ctx->trace_lock'.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+read_aux(struct perf_ctx *tr_ctx)
+{
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+    struct perf_trace *trace = &tr_ctx->trace;
+    void *aux_buf = tr_ctx->aux_buf;
+
+    // Use of atomics here for the same reasons as for handle_sample().
+    __u64 head_monotonic =
+        atomic_load_explicit((_Atomic __u64 *)&hdr->aux_head,
+                             memory_order_acquire);
+    __u64 size = tr_ctx->aux_bufsize;   // Constant value.
+    __u64 head = head_monotonic % size; // Head must be manually wrapped.
+    __u64 tail = tr_ctx->aux_last % size;
+    __u64 new_data_size = head_monotonic - tr_ctx->aux_last;
+
+    if (new_data_size == 0)
+        return true;
+
+    // Reallocate the trace storage buffer if more space is required.
+    __u64 required_capacity = trace->len + new_data_size;
+    if (required_capacity > trace->capacity)
+    {
+        // Over-allocate to 2x what we need, checking that the result fits in
+        // the size_t argument of realloc(3).
+        if (required_capacity >= SIZE_MAX / 2)
+        {
+            printf("Error: trace buffer too big");
+            return false;
+        }
+        size_t new_capacity = required_capacity * 2;
+        void *new_buf = realloc(trace->buf, new_capacity);
+        if (new_buf == NULL)
+        {
+            printf("Error: growing trace buffer");
+            return false;
+        }
+        trace->capacity = new_capacity;
+        trace->buf = new_buf;
+    }
+
+    // Finally append the new AUX data to the end of the trace storage buffer.
+    if (tail < head)
+    {
+        memcpy(trace->buf + trace->len, aux_buf + tail, head - tail);
+    }
+    else
+    {
+        memcpy(trace->buf + trace->len, aux_buf + tail, size - tail);
+        memcpy(trace->buf + trace->len + size - tail, aux_buf, head);
+    }
+    trace->len += new_data_size;
+
+    tr_ctx->aux_last = head_monotonic;
+    atomic_store_explicit((_Atomic __u64 *)&hdr->aux_tail, head_monotonic,
+                          memory_order_release);
+    return true;
+}
+
+/*
+ * Take trace data out of the AUX buffer until told to stop.
+ *
+ * Returns true on success and false otherwise.
+ */
+static bool
+poll_loop(struct perf_ctx *tr_ctx)
+{
+    struct perf_event_mmap_page *mmap_hdr = tr_ctx->base_buf;
+    int n_events = 0;
+    bool ret = true;
+    struct pollfd pfds[2] = {
+        {tr_ctx->perf_fd, POLLIN | POLLHUP, 0},
+        {tr_ctx->stop_fds[0], POLLHUP, 0}};
+
+    // Temporary space for new samples in the data buffer.
+    void *data_tmp = malloc(mmap_hdr->data_size);
+    if (data_tmp == NULL)
+    {
+        printf("Error: allocating sample buffer");
+        ret = false;
+        goto done;
+    }
+
+    while (1)
+    {
+        n_events = poll(pfds, 2, INFTIM);
+        if (n_events == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("Error: polling perf fd");
+            ret = false;
+            goto done;
+        }
+
+        // POLLIN on pfds[0]: Watermark reached on the Perf AUX or data buffer.
+        // POLLHUP on pfds[1]: Trace collection stopped by parent.
+        if ((pfds[0].revents & POLLIN) || (pfds[1].revents & POLLHUP))
+        {
+            // Read from the Perf file descriptor.
+            // We don't actually use any of what we read, but it's probably
+            // best that we drain the fd anyway.
+            struct read_format fd_data;
+            if (pfds[0].revents & POLLIN)
+            {
+                if (read(tr_ctx->perf_fd, &fd_data, sizeof(fd_data)) == -1)
+                {
+                    printf("Error: reading perf fd");
+                    ret = false;
+                    break;
+                }
+            }
+
+            if (!handle_sample(tr_ctx, data_tmp, true))
+            {
+                ret = false;
+                break;
+            }
+
+            if (pfds[1].revents & POLLHUP)
+            {
+                break;
+            }
+        }
+
+        // The traced thread exited.
+        if (pfds[0].revents & POLLHUP)
+        {
+            break;
+        }
+    }
+
+done:
+    if (data_tmp != NULL)
+    {
+        free(data_tmp);
+    }
+
+    return ret;
+}
+
+/*
+ * Body of the drain thread: copy AUX data out while the tracee runs.
+ */
+static void *
+collector_thread(void *arg)
+{
+    struct perf_ctx *tr_ctx = arg;
+
+    return (void *)poll_loop(tr_ctx);
+}
+
+/*
+ * Spawn the thread that drains the AUX buffer on watermark wakeups.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+start_drain(struct perf_ctx *tr_ctx)
+{
+    // A pipe to signal the drain thread to stop.
+    //
+    // It has to be a pipe because it needs to be used in a poll(2) loop later.
+    if (pipe(tr_ctx->stop_fds) != 0)
+    {
+        printf("Error: creating stop pipe");
+        return false;
+    }
+
+    if (pthread_mutex_init(&tr_ctx->trace_lock, NULL) != 0)
+    {
+        printf("Error: creating trace lock");
+        return false;
+    }
+
+    if (pthread_create(&tr_ctx->collector_thread, NULL, collector_thread, tr_ctx) != 0)
+    {
+        printf("Error: spawning collector thread");
+        pthread_mutex_destroy(&tr_ctx->trace_lock);
+        return false;
+    }
+    tr_ctx->draining = true;
+    return true;
+}
+
+/*
+ * Stop the drain thread and wait for it to exit.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+stop_drain(struct perf_ctx *tr_ctx)
+{
+    bool ret = true;
+
+    // Signal poll loop to end.
+    close(tr_ctx->stop_fds[1]);
+    tr_ctx->stop_fds[1] = -1;
+
+    // Wait for poll loop to exit.
+    void *thr_exit;
+    if (pthread_join(tr_ctx->collector_thread, &thr_exit) != 0)
+    {
+        printf("Error: joining collector thread");
+        ret = false;
+    }
+    else if ((bool)thr_exit != true)
+    {
+        printf("Error: inside collector thread");
+        ret = false;
+    }
+    close(tr_ctx->stop_fds[0]);
+    tr_ctx->stop_fds[0] = -1;
+
+    pthread_mutex_destroy(&tr_ctx->trace_lock);
+    tr_ctx->draining = false;
+    return ret;
+}
+
+/*
+ * Turn the event back on after an overflow in the current window, now that
+ * the ring has room again. The kernel turned it off, and nothing else would
+ * turn it on: the thread would go untraced for good.
+ */
+static void
+resume_event(struct perf_ctx *tr_ctx)
+{
+    if (!tr_ctx->window_lost)
+        return;
+    tr_ctx->truncated_resumed = tr_ctx->telemetry.truncated;
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_ENABLE, 0) == -1)
+        printf("Error: turning the PT event back on\n");
+}
+
+/*
+ * Does a PSB start at offset `offset' of the snapshot window? Reads the ring
+ * in place.
+ */
+static bool
+snapshot_psb_at(struct perf_ctx *tr_ctx, __u64 offset)
+{
+    __u64 size = tr_ctx->aux_bufsize;
+    __u64 pos = (tr_ctx->telemetry.aux_seen + offset) % size;
+    const uint8_t *ring = tr_ctx->aux_buf;
+
+    for (int i = 0; i < PSB_SIZE; i++)
+    {
+        if (ring[pos] != (i % 2 == 0 ? PSB_BYTE_0 : PSB_BYTE_1))
+            return false;
+        if (++pos == size)
+            pos = 0;
+    }
+    return true;
+}
+
+/*
+ * Map an AUX buffer of `size' bytes, replacing the current one if any. Trace
+ * still in the old buffer is dropped, the tail is moved up to the head, and
+ * `tail_dropped' is set so the decoder doesn't expect it back.
+ *
+ * Must only be called with the PT event disabled, or before it was first
+ * mapped: the kernel must not be writing to the buffer being replaced.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool
+map_aux(struct perf_ctx *tr_ctx, size_t size)
+{
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+
+    if (tr_ctx->aux_buf != NULL && munmap(tr_ctx->aux_buf, tr_ctx->aux_bufsize) == -1)
+    {
+        printf("Error: unmapping aux buffer");
+        return false;
+    }
+    tr_ctx->aux_buf = NULL;
+
+    // Mapped R/W so as to have a saturating ring buffer, or read-only for
+    // one the kernel keeps overwriting.
+    hdr->aux_offset = hdr->data_offset + hdr->data_size;
+    hdr->aux_size = size;
+    int prot = tr_ctx->snapshot ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *aux_buf = mmap(NULL, size, prot, MAP_SHARED, tr_ctx->perf_fd,
+                         hdr->aux_offset);
+    if (aux_buf == MAP_FAILED)
+        return false;
+
+    // Windows that wrap around the end of the AUX ring are linearised here.
+    void *wrap_buf = realloc(tr_ctx->wrap_buf, size);
+    if (wrap_buf == NULL)
+    {
+        munmap(aux_buf, size);
+        printf("Error: allocating wrap buffer");
+        return false;
+    }
+    tr_ctx->aux_buf = aux_buf;
+    tr_ctx->aux_bufsize = size;
+    tr_ctx->wrap_buf = wrap_buf;
+
+    // The head keeps counting across buffers, start the new one empty.
+    __u64 head = atomic_load_explicit((_Atomic __u64 *)&hdr->aux_head,
+                                      memory_order_acquire);
+    tr_ctx->tail_dropped |= tr_ctx->aux_last != head;
+    tr_ctx->aux_last = tr_ctx->telemetry.aux_seen = head;
+    atomic_store_explicit((_Atomic __u64 *)&hdr->aux_tail, head,
+                          memory_order_release);
+    return true;
+}
+
+/*
+ * Resize the AUX buffer after a window if it overflowed or came close to, or
+ * if it has been mostly idle for a while, within [aux_min_bufsize, aux_max_bufsize].
+ * Idle is judged on how much trace each window produced, see
+ * perf_next_window(). Trace kept in the ring is dropped by either.
+ *
+ * The event is disabled around the remap and enabled again afterwards, so the
+ * traced thread must be stopped.
+ */
+static void
+adapt_aux_size(struct perf_ctx *tr_ctx)
+{
+    struct perf_telemetry *tel = &tr_ctx->telemetry;
+    size_t size = tr_ctx->aux_bufsize;
+    size_t new_size = size;
+
+    // The drain thread empties the ring as it fills, so only truncation
+    // counts then.
+    if (tel->truncated != tel->truncated_seen ||
+        (!tr_ctx->draining && tel->last_window > size * AUX_GROW_RATIO))
+    {
+        tel->truncated_seen = tel->truncated;
+        tel->idle_windows = 0;
+        new_size = size * 2;
+        if (new_size > tr_ctx->aux_max_bufsize)
+            new_size = tr_ctx->aux_max_bufsize;
+    }
+    else if (tel->idle_windows >= AUX_SHRINK_WINDOWS)
+    {
+        tel->idle_windows = 0;
+        new_size = size / 2;
+        if (new_size < tr_ctx->aux_min_bufsize)
+            new_size = tr_ctx->aux_min_bufsize;
+    }
+
+    if (new_size == size)
+        return;
+
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_DISABLE, 0) == -1)
+    {
+        printf("Error: disabling the PT event to resize\n");
+        return;
+    }
+
+    if (map_aux(tr_ctx, new_size))
+        tel->resizes++;
+    else
+    {
+        // Probably out of locked memory, stay where we were.
+        printf("Warning: resizing AUX buffer to %zu bytes failed\n", new_size);
+        tr_ctx->aux_max_bufsize = size;
+        if (!map_aux(tr_ctx, size))
+            printf("Error: restoring AUX buffer\n");
+    }
+
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_ENABLE, 0) == -1)
+        printf("Error: enabling the PT event after resizing\n");
+}
+
+/*
+ * Opens the perf file descriptor and returns it. A PERF_RECORD_AUX is
+ * written every `aux_watermark' bytes of trace.
+ *
+ * With `at_exec' the event starts disabled and the kernel enables it when
+ * the task execs, so tracing begins at the new image's first instruction.
+ * Otherwise the task must be stopped and the event is enabled right away.
  *
  * Returns a file descriptor, or -1 on error.
  */
 static int
-open_perf(size_t aux_bufsize, pid_t traceepid, struct stats_config *stats)
+open_perf(size_t aux_watermark, pid_t traceepid, bool at_exec, struct stats_config *stats)
 {
     struct perf_event_attr attr;
     memset(&attr, 0, sizeof(attr));
@@ -98,7 +838,14 @@ open_perf(size_t aux_bufsize, pid_t traceepid, struct stats_config *stats)
     if (stats->pinfo)
         printf("Intel PT type: %d\n", attr.type);
 
-    attr.config = 0x300e601;
+    // Only ask for the packets the knobs enable.
+    if (!pt_knobs_attr_config(&stats->ptknobs, &attr.config))
+    {
+        ret = -1;
+        goto clean;
+    }
+    if (stats->pinfo)
+        printf("Intel PT config: 0x%llx\n", (unsigned long long)attr.config);
 
     // Exclude the kernel.
     attr.exclude_kernel = 1;
@@ -106,18 +853,30 @@ open_perf(size_t aux_bufsize, pid_t traceepid, struct stats_config *stats)
     // Exclude the hyper-visor.
     attr.exclude_hv = 1;
 
-    // Start disabled.
-    attr.disabled = 1;
+    // The event then stays on for good, the tracer never toggles it.
+    // Inheriting it would be no use, as per-task events with inherit can't
+    // be mmap(2)ed, so every thread gets an event of its own instead.
+    attr.disabled = at_exec;
+    attr.enable_on_exec = at_exec;
 
     // No skid.
     attr.precise_ip = 3;
 
+    // Sideband: executable mappings for the decoder image, and task events.
+    attr.mmap = 1;
+    attr.mmap2 = 1;
+    attr.comm = 1;
+    attr.comm_exec = 1;
+    attr.task = 1;
+
     // Notify for every sample.
     attr.watermark = 1;
     attr.wakeup_watermark = 1;
 
     // Generate a PERF_RECORD_AUX sample when the AUX buffer is almost full.
-    attr.aux_watermark = (size_t)((double)aux_bufsize * getpagesize()) * AUX_BUF_WAKE_RATIO;
+    // This is fixed for the life of the event, whatever size the buffer is
+    // later given.
+    attr.aux_watermark = aux_watermark;
 
     // Acquire file descriptor through which to talk to Intel PT. This syscall
     // could return EBUSY, meaning another process or thread has locked the
@@ -162,7 +921,8 @@ clean:
  * Initialise a collector context.
  */
 struct perf_ctx *
-perf_init_collector(struct perf_collector_config *tr_conf, pid_t traceepid, struct stats_config *stats)
+perf_init_collector(struct perf_collector_config *tr_conf, pid_t traceepid,
+                    bool at_exec, struct stats_config *stats)
 {
     struct perf_ctx *tr_ctx = NULL;
     bool failing = false;
@@ -178,10 +938,15 @@ perf_init_collector(struct perf_collector_config *tr_conf, pid_t traceepid, stru
 
     // Set default values.
     memset(tr_ctx, 0, sizeof(*tr_ctx));
+    tr_ctx->stop_fds[0] = tr_ctx->stop_fds[1] = -1;
     tr_ctx->perf_fd = -1;
+    tr_ctx->mmaps_tail = &tr_ctx->mmaps;
+    tr_ctx->verbose = stats->pinfo;
 
     // Obtain a file descriptor through which to speak to perf.
-    tr_ctx->perf_fd = open_perf(tr_conf->aux_bufsize, traceepid, stats);
+    int page_size = getpagesize();
+    size_t aux_watermark = tr_conf->aux_bufsize * page_size * AUX_BUF_WAKE_RATIO;
+    tr_ctx->perf_fd = open_perf(aux_watermark, traceepid, at_exec, stats);
     if (tr_ctx->perf_fd == -1)
     {
         printf("Error: obtaining a perf_event file descriptor");
@@ -210,7 +975,6 @@ perf_init_collector(struct perf_collector_config *tr_conf, pid_t traceepid, stru
     //
     // Data buffer is preceded by one management page (the header), hence `1 +
     // data_bufsize'.
-    int page_size = getpagesize();
     // printf("\n%d\n",page_size);
     tr_ctx->base_bufsize = (1 + tr_conf->data_bufsize) * page_size;
     tr_ctx->base_buf = mmap(NULL, tr_ctx->base_bufsize, PROT_WRITE, MAP_SHARED, tr_ctx->perf_fd, 0);
@@ -222,24 +986,53 @@ perf_init_collector(struct perf_collector_config *tr_conf, pid_t traceepid, stru
         goto clean;
     }
 
-    // Populate the header part of the base buffer.
-    struct perf_event_mmap_page *base_header = tr_ctx->base_buf;
-    base_header->aux_offset = base_header->data_offset + base_header->data_size;
-    base_header->aux_size = tr_ctx->aux_bufsize =
-        tr_conf->aux_bufsize * page_size;
-
-    // Allocate the AUX buffer.
-    //
-    // Mapped R/W so as to have a saturating ring buffer.
-    tr_ctx->aux_buf = mmap(NULL, base_header->aux_size, PROT_READ | PROT_WRITE,
-                           MAP_SHARED, tr_ctx->perf_fd, base_header->aux_offset);
-    if (tr_ctx->aux_buf == MAP_FAILED)
+    // Allocate the AUX buffer, which may be resized after every window.
+    tr_ctx->snapshot = stats->snapshot;
+    tr_ctx->aux_min_bufsize = tr_conf->aux_min_bufsize * page_size;
+    tr_ctx->aux_max_bufsize = tr_conf->aux_max_bufsize * page_size;
+    // The drain thread wakes up on AUX records, which come every
+    // `aux_watermark' bytes: a ring smaller than two of them would fill up
+    // before it gets to run.
+    if (stats->drain && tr_ctx->aux_min_bufsize < 2 * aux_watermark)
+        tr_ctx->aux_min_bufsize = 2 * aux_watermark;
+    if (!map_aux(tr_ctx, tr_conf->aux_bufsize * page_size))
     {
         printf("Error: mapping aux buffer");
         failing = true;
         goto clean;
     }
 
+    // Records in the data buffer are read at every window, unless the drain
+    // thread does it.
+    struct perf_event_mmap_page *base_header = tr_ctx->base_buf;
+    tr_ctx->data_tmp = malloc(base_header->data_size);
+    if (tr_ctx->data_tmp == NULL)
+    {
+        printf("Error: allocating sample buffer");
+        failing = true;
+        goto clean;
+    }
+
+    // Optionally copy the AUX data out as it is produced, so the tracee can
+    // run for long between syscalls without overflowing the ring.
+    if (stats->drain)
+    {
+        tr_ctx->trace.buf = malloc(tr_conf->initial_trace_bufsize);
+        if (tr_ctx->trace.buf == NULL)
+        {
+            printf("Error: allocating trace buffer");
+            failing = true;
+            goto clean;
+        }
+        tr_ctx->trace.capacity = tr_conf->initial_trace_bufsize;
+
+        if (!start_drain(tr_ctx))
+        {
+            failing = true;
+            goto clean;
+        }
+    }
+
 clean:
     if (failing && (tr_ctx != NULL))
     {
@@ -249,6 +1042,223 @@ clean:
     return tr_ctx;
 }
 
+/*
+ * Get the AUX data written since the last released window.
+ *
+ * The kernel advances `aux_head' as it writes trace into the AUX ring, and
+ * won't overwrite anything past `aux_tail', so [aux_last, aux_head) is exactly
+ * the trace produced since we last looked. A contiguous window is handed out
+ * in place; one that wraps around the end of the ring is copied into
+ * `wrap_buf' first, so the decoder always sees a linear byte array.
+ *
+ * When the drain thread is running, the window is instead whatever it has
+ * copied out so far plus the AUX data left since its last wakeup. The drain
+ * thread is held off until the window is released.
+ *
+ * The window stays valid until perf_release_window() is called.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool perf_next_window(struct perf_ctx *tr_ctx, void **window, size_t *len)
+{
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+    struct perf_telemetry *tel = &tr_ctx->telemetry;
+
+    // A failed resize left us without a buffer.
+    if (tr_ctx->aux_buf == NULL)
+        return false;
+
+    // Records the drain thread hasn't got to yet, MMAP2 ones in particular,
+    // belong to this window too.
+    if (!handle_sample(tr_ctx, tr_ctx->data_tmp, tr_ctx->draining))
+        return false;
+
+    if (tr_ctx->draining)
+        pthread_mutex_lock(&tr_ctx->trace_lock);
+
+    // Mappings made before the end of this window must be in the image when
+    // it is decoded. The decoder takes them from `window_mmaps'; any it left
+    // there are still to be applied.
+    struct perf_mmap **end = &tr_ctx->window_mmaps;
+    while (*end != NULL)
+        end = &(*end)->next;
+    *end = tr_ctx->mmaps;
+    tr_ctx->mmaps = NULL;
+    tr_ctx->mmaps_tail = &tr_ctx->mmaps;
+
+    // The kernel turns the event off when trace doesn't fit in the ring:
+    // after writing a truncated record, or when it finds no room at all.
+    // Either way the thread ran untraced from there up to this window's end.
+    __u64 aux_head = atomic_load_explicit((_Atomic __u64 *)&hdr->aux_head,
+                                          memory_order_acquire);
+    tr_ctx->window_lost = tel->truncated != tr_ctx->truncated_resumed ||
+                          (!tr_ctx->snapshot &&
+                           aux_head - tr_ctx->aux_last >= tr_ctx->aux_bufsize);
+
+    // Account for the trace produced since the last window.
+    __u64 produced = aux_head - tel->aux_seen;
+    tel->aux_seen += produced;
+    tel->windows++;
+    tel->bytes += produced;
+    tel->last_window = produced;
+    if (produced > tel->max_window)
+        tel->max_window = produced;
+    if (produced < tr_ctx->aux_bufsize * AUX_IDLE_RATIO)
+        tel->idle_windows++;
+    else
+        tel->idle_windows = 0;
+
+    if (tr_ctx->snapshot)
+    {
+        // The kernel keeps overwriting the ring, the window is all of it,
+        // oldest first. The ring starts zeroed, which decodes as PAD
+        // packets. Nothing is copied yet: the decoder only asks for the
+        // tail it needs, see perf_snapshot_psb().
+        *window = tr_ctx->wrap_buf;
+        *len = tr_ctx->aux_bufsize;
+        tr_ctx->snapshot_from = tr_ctx->aux_bufsize;
+        return true;
+    }
+
+    if (tr_ctx->draining)
+    {
+        if (!read_aux(tr_ctx))
+        {
+            pthread_mutex_unlock(&tr_ctx->trace_lock);
+            return false;
+        }
+        *window = tr_ctx->trace.buf;
+        *len = tr_ctx->trace.len;
+        return true;
+    }
+
+    // Acquire ordering so we can't read the AUX buffer before the head that
+    // covers it. See the comment in the Linux kernel sources for more:
+    // https://github.com/torvalds/linux/blob/3be4aaf4e2d3eb95cce7835e8df797ae65ae5ac1/kernel/events/ring_buffer.c#L60-L85
+    __u64 head_monotonic =
+        atomic_load_explicit((_Atomic __u64 *)&hdr->aux_head,
+                             memory_order_acquire);
+    __u64 size = tr_ctx->aux_bufsize;
+    __u64 new_data_size = head_monotonic - tr_ctx->aux_last;
+
+    if (new_data_size > size)
+    {
+        printf("Error: AUX head ran past the tail\n");
+        return false;
+    }
+
+    // Head and tail must be manually wrapped.
+    __u64 head = head_monotonic % size;
+    __u64 tail = tr_ctx->aux_last % size;
+
+    if (new_data_size == 0 || tail < head)
+    {
+        // Not wrapped.
+        *window = tr_ctx->aux_buf + tail;
+    }
+    else
+    {
+        // Wrapped.
+        memcpy(tr_ctx->wrap_buf, tr_ctx->aux_buf + tail, size - tail);
+        memcpy(tr_ctx->wrap_buf + size - tail, tr_ctx->aux_buf, head);
+        *window = tr_ctx->wrap_buf;
+    }
+    *len = new_data_size;
+    return true;
+}
+
+/*
+ * Hand the first `consumed' bytes of the current window back to the kernel.
+ *
+ * Anything after `consumed' is kept and will start the next window. The
+ * decoder uses this to keep the trace from its last PSB onwards, as it can
+ * only resume decoding at a PSB.
+ *
+ * A snapshot ring has no tail, the kernel overwrites it regardless.
+ *
+ * If the event overflowed during the window, it is turned back on here.
+ */
+void perf_release_window(struct perf_ctx *tr_ctx, size_t consumed)
+{
+    struct perf_event_mmap_page *hdr = tr_ctx->base_buf;
+
+    if (tr_ctx->snapshot)
+        return;
+
+    if (tr_ctx->draining)
+    {
+        struct perf_trace *trace = &tr_ctx->trace;
+
+        memmove(trace->buf, trace->buf + consumed, trace->len - consumed);
+        trace->len -= consumed;
+        // Everything in the ring was copied out by read_aux().
+        adapt_aux_size(tr_ctx);
+        resume_event(tr_ctx);
+        pthread_mutex_unlock(&tr_ctx->trace_lock);
+        return;
+    }
+
+    tr_ctx->aux_last += consumed;
+
+    // Release ordering so we're done reading the window before the kernel
+    // may reuse it.
+    atomic_store_explicit((_Atomic __u64 *)&hdr->aux_tail, tr_ctx->aux_last,
+                          memory_order_release);
+
+    // Resizing drops the trace after the last PSB, see `tail_dropped'.
+    adapt_aux_size(tr_ctx);
+    resume_event(tr_ctx);
+}
+
+/*
+ * Find the last PSB before offset `before' of the current snapshot window,
+ * searching the ring in place, and make the window valid from there on.
+ *
+ * Returns true and its offset in `psb', or false if there is none.
+ */
+bool perf_snapshot_psb(struct perf_ctx *tr_ctx, uint64_t before, uint64_t *psb)
+{
+    if (before > tr_ctx->aux_bufsize)
+        before = tr_ctx->aux_bufsize;
+    if (before < PSB_SIZE)
+        return false;
+
+    for (uint64_t offset = before - PSB_SIZE + 1; offset-- > 0;)
+    {
+        if (!snapshot_psb_at(tr_ctx, offset))
+            continue;
+        // The last match may be the end of a longer run of the pattern,
+        // the packet starts with the run.
+        while (offset >= 2 && snapshot_psb_at(tr_ctx, offset - 2))
+            offset -= 2;
+        perf_snapshot_fill(tr_ctx, offset);
+        *psb = offset;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Copy the current snapshot window into `wrap_buf' from offset `from' on,
+ * past what is there already.
+ */
+void perf_snapshot_fill(struct perf_ctx *tr_ctx, uint64_t from)
+{
+    __u64 size = tr_ctx->aux_bufsize;
+    __u64 to = tr_ctx->snapshot_from;
+
+    if (from >= to)
+        return;
+
+    // Offset 0 of the window is the oldest byte in the ring, at the head.
+    __u64 pos = (tr_ctx->telemetry.aux_seen + from) % size;
+    __u64 len = to - from;
+    __u64 first = len < size - pos ? len : size - pos;
+    memcpy(tr_ctx->wrap_buf + from, tr_ctx->aux_buf + pos, first);
+    memcpy(tr_ctx->wrap_buf + from + first, tr_ctx->aux_buf, len - first);
+    tr_ctx->snapshot_from = from;
+}
+
 /*
  * Clean up and free a perf_ctx and its contents.
  *
@@ -258,6 +1268,20 @@ bool perf_free_collector(struct perf_ctx *tr_ctx)
 {
     int ret = true;
 
+    if (tr_ctx == NULL)
+        return ret;
+
+    if (tr_ctx->draining && !stop_drain(tr_ctx))
+        ret = false;
+    if (tr_ctx->stop_fds[0] >= 0)
+        close(tr_ctx->stop_fds[0]);
+    if (tr_ctx->stop_fds[1] >= 0)
+        close(tr_ctx->stop_fds[1]);
+    free(tr_ctx->trace.buf);
+    free(tr_ctx->wrap_buf);
+    free(tr_ctx->data_tmp);
+    perf_free_mmaps(tr_ctx->mmaps);
+    perf_free_mmaps(tr_ctx->window_mmaps);
     if ((tr_ctx->aux_buf) &&
         (munmap(tr_ctx->aux_buf, tr_ctx->aux_bufsize) == -1))
     {
@@ -275,9 +1299,36 @@ bool perf_free_collector(struct perf_ctx *tr_ctx)
         close(tr_ctx->perf_fd);
         tr_ctx->perf_fd = -1;
     }
-    if (tr_ctx != NULL)
+    free(tr_ctx);
+    return ret;
+}
+
+/*
+ * Print how much trace thread `tid' produced and how the AUX buffer coped.
+ */
+void perf_print_telemetry(struct perf_ctx *tr_ctx, pid_t tid)
+{
+    struct perf_telemetry *tel = &tr_ctx->telemetry;
+
+    printf("tid %d: %llu windows, %llu bytes, %llu max/window, "
+           "%llu truncated, %llu partial, %llu collisions, %llu lost, "
+           "%llu mmaps, %llu resizes, AUX %zu bytes\n",
+           tid, (unsigned long long)tel->windows, (unsigned long long)tel->bytes,
+           (unsigned long long)tel->max_window, (unsigned long long)tel->truncated,
+           (unsigned long long)tel->partial, (unsigned long long)tel->collisions,
+           (unsigned long long)tel->lost, (unsigned long long)tel->mmaps,
+           (unsigned long long)tel->resizes, tr_ctx->aux_bufsize);
+}
+
+/*
+ * Free a list of mappings.
+ */
+void perf_free_mmaps(struct perf_mmap *map)
+{
+    while (map != NULL)
     {
-        free(tr_ctx);
+        struct perf_mmap *next = map->next;
+        free(map);
+        map = next;
     }
-    return ret;
 }
@@ -10,26 +10,196 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
 #include "ptxed_util.c"
 #include "analyse_exec_flow.c"
 #include "pt_cpu.c"
 #include "pt_cpuid.c"
 #include "load_elf.c"
+#include "func_entries.c"
+#include "ret_sites.c"
 
-// Storage for executed instructions
-struct pt_insn execInst[100000];
+// Consecutive indirect branches to addresses that follow no call, the most
+// legitimate code makes before returning, see check_returns().
+#define RET_CHAIN_LIMIT 6
+
+// Windows at least this big are split at PSBs and decoded by --jobs threads,
+// in segments of at least PARALLEL_MIN_SEGMENT bytes.
+#define PARALLEL_MIN_WINDOW (1 << 20)
+#define PARALLEL_MIN_SEGMENT (256 << 10)
+#define MAX_JOBS 64
+
+// Slots in the per-image cache of indirect_branch() results, a power of two.
+#define BRANCH_CACHE_SIZE (1 << 14)
+
+/*
+ * A segment of a window, from one PSB up to the next segment's, decoded on a
+ * thread of its own.
+ */
+struct decode_segment
+{
+    pthread_t thread;
+    struct inst_decoder_ctx *ctx;   // Own decoder and image over the segment.
+    void *buf;                      // Start of the segment.
+    uint64_t len;                   // Length of the segment.
+    struct stats_config *stats;
+    uint32_t ninsn;                 // Instructions decoded.
+    int overflows;                  // Overflows seen.
+};
+
+// Code of the vdso, which has no file of its own for libipt to read, so
+// read_vdso() hands it out. Every process maps the same vdso, so one copy
+// serves all images.
+static uint8_t *vdso_code;
+static uint64_t vdso_size;
+
+/*
+ * An executable mapping of a process, as listed in /proc/<pid>/maps.
+ */
+struct proc_mapping
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    char *file;                 // Path, or "[vdso]".
+};
+
+/*
+ * The mappings an image was read from. Shared by the decoders of all threads
+ * of the process and owned with the image.
+ */
+struct proc_maps
+{
+    pid_t pid;                  // Process they belong to.
+    bool stale;                 // May they have changed since they were read?
+    struct proc_mapping *maps;  // Executable mappings, as last read.
+    int count;
+    uint64_t vdso;              // Where the vdso is mapped, or 0.
+};
+
+/*
+ * Decoder state that outlives a single trace window.
+ *
+ * The memory image is built once; a fresh libipt decoder is pointed at every
+ * new window of trace handed out by the collector.
+ */
+struct inst_decoder_ctx
+{
+    struct pt_config config;                // Template for per-window decoders.
+    struct pt_image *image;                 // Memory image of the tracee.
+    struct pt_image_section_cache *iscache; // Cache backing the image sections.
+    struct pt_insn_decoder *decoder;        // Decoder for the current window,
+    struct pt_block_decoder *blk_decoder;   // one of the two, see `use_insn'.
+    bool use_insn;                          // Decode instructions, not blocks?
+    int status;                             // Decoder status after syncing.
+    uint64_t sync_offset;                   // Window offset of the last PSB.
+    int insn_count;                         // Instructions in the last window.
+    uint64_t seen;                          // Window bytes the previous
+                                            // window analysed already. They
+                                            // are decoded again, not
+                                            // analysed again.
+    struct flow_state flow;                 // Analysis state of the thread.
+    struct flow_ring ring;                  // Its control transfers in the
+                                            // last window.
+    bool deferred;                          // Part of a window decoded for
+                                            // another context, which keeps
+                                            // the shadow stack.
+    uint64_t first_ip;                      // First IP decoded in the window.
+    int gaps;                               // Trace lost in the last window:
+    uint64_t lost_bytes;                    // errors resynced and overflows.
+    bool window_lost;                       // Did the AUX buffer overflow
+                                            // before the window's end?
+    struct ret_sites *ret_sites;            // Return sites of `image', for
+                                            // --retcheck. Owned with it.
+    int ret_run;                            // Returns in a row to no return
+                                            // site, up to the last window's
+                                            // end.
+    struct func_entries *func_entries;      // Its function entries, for
+                                            // --entries. Owned with it.
+    struct proc_maps *maps;                 // Where it was read from, if from
+                                            // a process. Owned with it.
+    uint64_t *branch_cache;                 // Is the branch at an IP of it
+                                            // indirect? `ip << 1 | indirect'
+                                            // slots, 0 if empty. Owned with it.
+    bool owns_image;                        // Free `image'?
+    bool owns_iscache;                      // Free `iscache'?
+    void *carry;                            // Trace left after the last PSB
+    size_t carry_len;                       // of a window decoded off a
+    size_t carry_capacity;                  // private copy.
+};
 
 // Private prototypes
 static int extract_base(const char *, uint64_t *);
+static uint64_t last_psb_offset(const struct pt_config *);
+static uint64_t count_branches(const struct pt_config *, uint8_t *, uint8_t *);
+static void free_window_decoder(struct inst_decoder_ctx *);
+static int decoder_sync_forward(struct inst_decoder_ctx *);
+static int decoder_get_offset(struct inst_decoder_ctx *, uint64_t *);
+static int decoder_get_sync_offset(struct inst_decoder_ctx *, uint64_t *);
+static int resync_decoder(struct inst_decoder_ctx *, int, struct stats_config *);
+static void return_target(struct inst_decoder_ctx *, struct flow_entry **, uint64_t);
+static struct flow_entry *record_branch(struct inst_decoder_ctx *, uint64_t,
+                                        enum pt_insn_class, uint32_t);
+static bool need_indirect(struct stats_config *, enum pt_insn_class, uint32_t);
+static bool indirect_branch(const uint8_t *, uint8_t);
+static bool block_indirect_branch(struct inst_decoder_ctx *, const struct pt_block *);
+static int branch_cache_get(struct inst_decoder_ctx *, uint64_t);
+static void branch_cache_put(struct inst_decoder_ctx *, uint64_t, bool);
+static void branch_cache_clear(struct inst_decoder_ctx *);
+static bool cached_indirect_branch(struct inst_decoder_ctx *, uint64_t,
+                                   const uint8_t *, uint8_t);
+static enum flow_ret check_return(struct inst_decoder_ctx *, uint64_t, uint64_t);
+static void check_target(struct inst_decoder_ctx *, struct flow_entry *);
+static void forget_flow(struct inst_decoder_ctx *);
+static int add_image_section(struct inst_decoder_ctx *, const char *, uint64_t,
+                             uint64_t, uint64_t);
+static int check_returns(struct inst_decoder_ctx *, uint64_t);
+static void decode_insns(struct inst_decoder_ctx *, struct stats_config *, int *,
+                         uint32_t *);
+static void decode_blocks(struct inst_decoder_ctx *, struct stats_config *, int *,
+                          uint32_t *);
+static void *decode_segment(void *);
+static void decode_segments(struct inst_decoder_ctx *, struct stats_config *, int *,
+                            uint32_t *);
+static bool check_snapshot(struct perf_ctx *, struct inst_decoder_ctx *,
+                           struct stats_config *);
+static struct inst_decoder_ctx *alloc_inst_decoder(struct pt_image_section_cache *,
+                                                   struct stats_config *);
+static bool read_vdso_code(pid_t, uint64_t, uint64_t);
+static int read_vdso(uint8_t *, size_t, const struct pt_asid *, uint64_t, void *);
+static int load_vdso(struct inst_decoder_ctx *, uint64_t, uint64_t, bool);
+static int read_maps(pid_t, struct proc_mapping **);
+static bool has_mapping(const struct proc_mapping *, int, const struct proc_mapping *);
+static void free_mappings(struct proc_mapping *, int);
+static struct proc_maps *copy_proc_maps(const struct proc_maps *, pid_t);
+static void free_proc_maps(struct proc_maps *);
+static bool load_process_maps(struct inst_decoder_ctx *);
+static void apply_window_mmaps(struct perf_ctx *, struct inst_decoder_ctx *);
 
 // Public prototypes.
-void *init_inst_decoder(void *buf, uint64_t len,
-                        int *decoder_status,
-                        const char *current_exe, struct stats_config *);
-bool decode_trace(struct pt_insn_decoder *decoder, int *decoder_status, struct stats_config *);
-void free_insn_decoder(struct pt_insn_decoder *);
+struct inst_decoder_ctx *init_inst_decoder(const char *current_exe,
+                                           struct pt_image_section_cache *,
+                                           struct stats_config *);
+struct inst_decoder_ctx *attach_inst_decoder(pid_t, struct pt_image_section_cache *,
+                                             struct stats_config *);
+struct inst_decoder_ctx *share_inst_decoder(struct inst_decoder_ctx *);
+struct inst_decoder_ctx *fork_inst_decoder(struct inst_decoder_ctx *,
+                                           struct inst_decoder_ctx *, pid_t);
+void watch_mappings(struct inst_decoder_ctx *, long);
+bool inst_decoder_stale(struct inst_decoder_ctx *);
+bool refresh_inst_decoder(struct inst_decoder_ctx *);
+bool set_decoder_window(struct inst_decoder_ctx *, void *buf, uint64_t len);
+bool decode_trace(struct inst_decoder_ctx *, struct stats_config *);
+bool check_window(struct perf_ctx *, struct inst_decoder_ctx *, struct stats_config *);
+void apply_mmaps(struct inst_decoder_ctx *, struct perf_mmap *);
+void free_insn_decoder(struct inst_decoder_ctx *);
+bool bench_dump(const char *dump, const char *exe, struct stats_config *);
 
 static int extract_base(const char *arg, uint64_t *base)
 {
@@ -57,39 +227,113 @@ static int extract_base(const char *arg, uint64_t *base)
 }
 
 /*
- * Get ready to retrieve instructions from a PT trace using the code of the
- * current process for control flow recovery.
+ * Find the offset of the last PSB in the trace described by `config`.
  *
- * Accepts a raw buffer `buf` of length `len`.
+ * A fresh packet decoder syncs backward from the end of its buffer, so this
+ * only scans the tail of the window.
  *
- * `current_exe` is an absolute path to an on-disk executable from which to
- * load the main executable's (i.e. not a shared library's) code.
+ * Returns the offset, or 0 if there is no PSB.
+ */
+static uint64_t last_psb_offset(const struct pt_config *config)
+{
+    struct pt_packet_decoder *pkt;
+    uint64_t offset = 0ull;
+
+    pkt = pt_pkt_alloc_decoder(config);
+    if (pkt == NULL)
+        return 0ull;
+
+    if (pt_pkt_sync_backward(pkt) < 0 ||
+        pt_pkt_get_sync_offset(pkt, &offset) < 0)
+        offset = 0ull;
+
+    pt_pkt_free_decoder(pkt);
+    return offset;
+}
+
+/*
+ * Count the branches traced in [begin, end), which must start at a PSB, from
+ * the packets alone: one per TNT bit and per TIP. Every one is an executed
+ * instruction.
  *
- * `*decoder_status` will be updated to reflect the status of the decoder after
- * it has been synchronised.
+ * Returns the count, up to the first packet error.
+ */
+static uint64_t count_branches(const struct pt_config *config, uint8_t *begin,
+                               uint8_t *end)
+{
+    struct pt_config seg = *config;
+    struct pt_packet_decoder *pkt;
+    struct pt_packet packet;
+    uint64_t branches = 0ull;
+
+    seg.begin = begin;
+    seg.end = end;
+    pkt = pt_pkt_alloc_decoder(&seg);
+    if (pkt == NULL)
+        return 0ull;
+
+    if (pt_pkt_sync_forward(pkt) >= 0)
+    {
+        while (pt_pkt_next(pkt, &packet, sizeof(packet)) >= 0)
+        {
+            if (packet.type == ppt_tnt_8 || packet.type == ppt_tnt_64)
+                branches += packet.payload.tnt.bit_size;
+            else if (packet.type == ppt_tip)
+                branches++;
+        }
+    }
+
+    pt_pkt_free_decoder(pkt);
+    return branches;
+}
+
+/*
+ * Allocate a decoder context with a CPU configuration and an empty image.
  *
- * Returns a pointer to a configured libipt block decoder or NULL on error.
+ * `iscache` is a section cache shared with other decoders, so that files
+ * mapped by several tracees are only loaded once. If NULL, the decoder gets
+ * a cache of its own.
+ *
+ * Returns a pointer to a decoder context or NULL on error.
  */
-void *
-init_inst_decoder(void *buf, uint64_t len,
-                  int *decoder_status, const char *current_exe, struct stats_config *stats)
+static struct inst_decoder_ctx *
+alloc_inst_decoder(struct pt_image_section_cache *iscache, struct stats_config *stats)
 {
     bool failing = false;
-    if (stats->praw)
+    if (stats->praw && bufferFd == NULL)
         bufferFd = fopen("buffer.out", "w+");
 
-    struct pt_config config;
-    memset(&config, 0, sizeof(config));
+    struct inst_decoder_ctx *ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL)
+    {
+        printf("Error: allocating decoder context");
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->status = -pte_eos;
+    ctx->owns_image = true;
+
+    struct pt_config *config = &ctx->config;
 
     // pt_config_init(&config);
 
-    config.size = sizeof(config);
-    config.begin = buf;
-    config.end = buf + len;
+    config->size = sizeof(*config);
+
+    // Match the packets the collector asked for.
+    pt_knobs_decoder_config(&stats->ptknobs, config);
+
+    // The analysis only needs the branches, which the block decoder finds
+    // without stepping through every instruction. Printing them needs the
+    // instruction decoder.
+    ctx->use_insn = stats->pinst || stats->praw;
+    if (!ctx->use_insn)
+    {
+        // Direct calls are followed into the callee by default.
+        config->flags.variant.block.end_on_call = 1;
+    }
 
     // Decode for the current CPU.
-    struct pt_insn_decoder *decoder = NULL;
-    int rv = pt_cpu_read(&config.cpu);
+    int rv = pt_cpu_read(&config->cpu);
     if (rv != pte_ok)
     {
         printf("Error: reading cpu");
@@ -98,9 +342,9 @@ init_inst_decoder(void *buf, uint64_t len,
     }
 
     // Work around CPU bugs.
-    if (config.cpu.vendor)
+    if (config->cpu.vendor)
     {
-        rv = pt_cpu_errata(&config.errata, &config.cpu);
+        rv = pt_cpu_errata(&config->errata, &config->cpu);
         if (rv < 0)
         {
             printf("Error: working around bugs");
@@ -109,186 +353,1746 @@ init_inst_decoder(void *buf, uint64_t len,
         }
     }
 
-    // Instantiate a decoder.
-    decoder = pt_insn_alloc_decoder(&config);
-    if (decoder == NULL)
+    // Build and load a memory image from which to recover control flow.
+    ctx->image = pt_image_alloc(NULL);
+    if (ctx->image == NULL)
     {
-        printf("Error: instantiating decoder");
+        printf("Error: allocating image");
         failing = true;
         goto clean;
     }
-
-    // Sync the decoder.
-    *decoder_status = pt_insn_sync_forward(decoder);
-    if (*decoder_status == -pte_eos)
+    // Use image cache to speed up decoding.
+    ctx->iscache = iscache;
+    if (ctx->iscache == NULL)
     {
-        // There were no blocks in the stream. The user will find out on next
-        // call to hwt_ipt_next_block().
-        goto clean;
+        ctx->iscache = pt_iscache_alloc(NULL);
+        ctx->owns_iscache = true;
     }
-    else if (*decoder_status < 0)
+
+    if (ctx->iscache == NULL)
     {
-        printf("Error: synchronising decoder");
+        printf("Error: allocating cache");
         failing = true;
         goto clean;
     }
 
-    // Build and load a memory image from which to recover control flow.
-    struct pt_image *image = pt_image_alloc(NULL);
-    if (image == NULL)
+    // XED is set up once, before any decoding thread needs it.
+    xed_tables_init();
+
+    // Only as many branches as --depth can look at.
+    if (!flow_ring_init(&ctx->ring, stats->limited ? stats->depth + 1u
+                                                   : FLOW_RING_DEFAULT))
     {
-        printf("Error: allocating image");
         failing = true;
         goto clean;
     }
-    // Use image cache to speed up decoding.
-    struct pt_image_section_cache *iscache = pt_iscache_alloc(NULL);
 
-    if (iscache == NULL)
+    if (stats->retcheck)
     {
-        printf("Error: allocating cache");
-        failing = true;
-        goto clean;
+        ctx->ret_sites = ret_sites_alloc();
+        if (ctx->ret_sites == NULL)
+        {
+            failing = true;
+            goto clean;
+        }
     }
 
-    int64_t base;
-    base = 0ull;
-
-    int errcode = extract_base(current_exe, &base);
-    if (errcode < 0)
+    if (stats->entries)
     {
-        printf("Error: Extracting base");
-        failing = true;
-        goto clean;
+        ctx->func_entries = func_entries_alloc();
+        if (ctx->func_entries == NULL)
+        {
+            failing = true;
+            goto clean;
+        }
     }
 
-    errcode = load_elf(iscache, image, current_exe, base, "ptxed_util");
-
-    rv = pt_insn_set_image(decoder, image);
-    if (rv < 0)
+    // Only needed when branches are told apart, see need_indirect().
+    if (stats->entries || stats->gadget_chain > 0)
     {
-        printf("Error: setting image to decoder");
-        failing = true;
-        goto clean;
+        ctx->branch_cache = calloc(BRANCH_CACHE_SIZE, sizeof(*ctx->branch_cache));
+        if (ctx->branch_cache == NULL)
+        {
+            printf("Error: allocating branch cache");
+            failing = true;
+            goto clean;
+        }
     }
 
 clean:
     if (failing)
     {
-        pt_insn_free_decoder(decoder);
+        free_insn_decoder(ctx);
         return NULL;
     }
-    return decoder;
+    return ctx;
 }
 
 /*
+ * Get ready to retrieve instructions from a PT trace using the code of the
+ * current process for control flow recovery.
  *
- * Decodes intel PT
+ * `current_exe` is an absolute path to an on-disk executable from which to
+ * load the main executable's (i.e. not a shared library's) code.
+ *
+ * `iscache` is shared as for alloc_inst_decoder().
  *
+ * No trace is attached yet, see set_decoder_window().
+ *
+ * Returns a pointer to a decoder context or NULL on error.
  */
-bool decode_trace(struct pt_insn_decoder *decoder, int *decoder_status, struct stats_config *stats)
+struct inst_decoder_ctx *
+init_inst_decoder(const char *current_exe, struct pt_image_section_cache *iscache,
+                  struct stats_config *stats)
 {
-    xed_state_t xed;
-    if (stats->pinst)
+    struct inst_decoder_ctx *ctx = alloc_inst_decoder(iscache, stats);
+    if (ctx == NULL)
+        return NULL;
+
+    uint64_t base;
+    base = 0ull;
+
+    int errcode = extract_base(current_exe, &base);
+    if (errcode < 0)
     {
-        xed_state_zero(&xed);
-        xed_tables_init();
+        printf("Error: Extracting base");
+        free_insn_decoder(ctx);
+        return NULL;
     }
 
-    uint64_t offset, sync;
+    errcode = load_elf(ctx->iscache, ctx->image, current_exe, base, "ptxed_util");
 
-    offset = 0ull;
-    int errcode;
+    // The executable is loaded at its link address unless given a base.
+    if ((ctx->ret_sites != NULL || ctx->func_entries != NULL) && base == 0ull)
+    {
+        struct elf_range ranges[16];
+        int n = load_elf_text(current_exe, ranges, 16, "ptxed_util");
+        for (int i = 0; i < n; i++)
+        {
+            if (ctx->ret_sites != NULL)
+                ret_sites_add_file(ctx->ret_sites, current_exe, ranges[i].offset,
+                                   ranges[i].size, ranges[i].vaddr);
+            if (ctx->func_entries != NULL)
+                func_entries_add_file(ctx->func_entries, current_exe, ranges[i].offset,
+                                      ranges[i].size, ranges[i].vaddr);
+        }
+    }
+    return ctx;
+}
 
-    int status = *decoder_status;
-    struct pt_insn insn;
+/*
+ * Read the vdso of process `pid', mapped at `vaddr' with size `size', through
+ * /proc/<pid>/mem, which needs the process to be stopped. Only done once.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool read_vdso_code(pid_t pid, uint64_t vaddr, uint64_t size)
+{
+    char path[64];
+    uint8_t *code;
+    bool ok;
 
-    // Used to keep track of the number of instructions
-    int counter = 0;
+    if (vdso_code != NULL)
+        return true;
 
-    /* Initialize the IP - we use it for error reporting. */
-    insn.ip = 0ull;
+    code = malloc(size);
+    if (code == NULL)
+    {
+        printf("Error: allocating vdso");
+        return false;
+    }
 
-    for (;;)
+    snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+    int mem = open(path, O_RDONLY);
+    ok = mem != -1 && pread(mem, code, size, vaddr) == (ssize_t)size;
+    if (mem != -1)
+        close(mem);
+    if (!ok)
     {
-        status = drain_events_insn(decoder, status);
-        if (status < 0)
-        {
-            printf("Drain Events error \n");
-            break;
-        }
+        printf("Error: reading vdso of %d\n", pid);
+        free(code);
+        return false;
+    }
 
-        if (status & pts_eos)
-        {
-            // printf("[End of trace]\n");
-            break;
-        }
+    vdso_code = code;
+    vdso_size = size;
+    return true;
+}
 
-        errcode = pt_insn_get_offset(decoder, &offset);
-        if (errcode < 0)
-        {
-            printf("Get offset error");
-            break;
-        }
+/*
+ * Image callback for code in no section: serve the vdso of the process whose
+ * struct proc_maps is `context'.
+ *
+ * Returns the number of bytes read, or -pte_nomap outside of the vdso.
+ */
+static int read_vdso(uint8_t *buffer, size_t size, const struct pt_asid *asid,
+                     uint64_t ip, void *context)
+{
+    const struct proc_maps *maps = context;
+    (void)asid;
 
-        status = pt_insn_next(decoder, &insn, sizeof(insn));
-        if (status < 0)
+    if (vdso_code == NULL || maps->vdso == 0ull || ip < maps->vdso ||
+        ip - maps->vdso >= vdso_size)
+        return -pte_nomap;
+
+    uint64_t offset = ip - maps->vdso;
+    if (size > vdso_size - offset)
+        size = vdso_size - offset;
+    memcpy(buffer, vdso_code + offset, size);
+    return (int)size;
+}
+
+/*
+ * Make the vdso of the process of `ctx', mapped at `vaddr' with size `size',
+ * available to the decoder. libipt reads it through read_vdso(); its return
+ * sites and function entries are added unless it was `known' already.
+ *
+ * Returns 0 on success or a negative libipt error code otherwise.
+ */
+static int load_vdso(struct inst_decoder_ctx *ctx, uint64_t vaddr, uint64_t size,
+                     bool known)
+{
+    if (!read_vdso_code(ctx->maps->pid, vaddr, size))
+        return -pte_bad_file;
+    if (size > vdso_size)
+        size = vdso_size;
+    ctx->maps->vdso = vaddr;
+    if (known)
+        return 0;
+
+    branch_cache_clear(ctx);
+
+    if (ctx->ret_sites != NULL &&
+        !ret_sites_add_code(ctx->ret_sites, vdso_code, size, vaddr))
+        printf("warning: [vdso]: no return sites\n");
+    if (ctx->func_entries != NULL &&
+        !func_entries_add_code(ctx->func_entries, "[vdso]", vdso_code, size, vaddr))
+        printf("warning: [vdso]: no function entries\n");
+    return 0;
+}
+
+/*
+ * Read the executable mappings of process `pid' whose code libipt can get
+ * to: those of files, and the vdso. Anonymous executable memory is skipped.
+ *
+ * Returns the number of mappings, stored in `*out', or -1 on error.
+ */
+static int read_maps(pid_t pid, struct proc_mapping **out)
+{
+    char path[64], line[PATH_MAX + 128], perms[8], file[PATH_MAX];
+    unsigned long long start, end, offset, inode;
+    struct proc_mapping *maps = NULL;
+    int count = 0, capacity = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    f = fopen(path, "r");
+    if (f == NULL)
+    {
+        printf("Error: opening %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        file[0] = '\0';
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %llu %4095[^\n]",
+                   &start, &end, perms, &offset, &inode, file) < 5)
+            continue;
+        if (perms[2] != 'x' || (file[0] != '/' && strcmp(file, "[vdso]") != 0))
+            continue;
+
+        if (count == capacity)
         {
-            /* Even in case of errors, we may have succeeded
-             * in decoding the current instruction.
-             */
-            print_insn(&insn, &xed, offset);
-            printf("Error fetching instruction\n");
+            int new_capacity = capacity ? capacity * 2 : 32;
+            void *new_maps = realloc(maps, new_capacity * sizeof(*maps));
+            if (new_maps == NULL)
+                goto fail;
+            maps = new_maps;
+            capacity = new_capacity;
         }
+        maps[count].file = strdup(file);
+        if (maps[count].file == NULL)
+            goto fail;
+        maps[count].start = start;
+        maps[count].end = end;
+        maps[count].offset = offset;
+        count++;
+    }
+    fclose(f);
 
-        execInst[counter] = insn;
-        counter++;
+    *out = maps;
+    return count;
 
-        if(counter>99997)
-            counter= stats->depth+1;
+fail:
+    printf("Error: reading %s\n", path);
+    fclose(f);
+    free_mappings(maps, count);
+    return -1;
+}
 
-        if (stats->pinst)
-            print_insn(&insn, &xed, offset);
+/*
+ * Is `map' one of the `count' mappings in `maps'?
+ */
+static bool has_mapping(const struct proc_mapping *maps, int count,
+                        const struct proc_mapping *map)
+{
+    for (int i = 0; i < count; i++)
+        if (maps[i].start == map->start && maps[i].end == map->end &&
+            maps[i].offset == map->offset && strcmp(maps[i].file, map->file) == 0)
+            return true;
+    return false;
+}
 
-        if (stats->praw)
-            print_raw_insn_file(&insn);
+static void free_mappings(struct proc_mapping *maps, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(maps[i].file);
+    free(maps);
+}
+
+/*
+ * Copy `maps' for the image of process `pid', forked from theirs.
+ *
+ * Returns the copy or NULL on error.
+ */
+static struct proc_maps *copy_proc_maps(const struct proc_maps *maps, pid_t pid)
+{
+    struct proc_maps *copy = calloc(1, sizeof(*copy));
+    if (copy == NULL)
+        goto fail;
+    copy->pid = pid;
+    copy->stale = maps->stale;
+    copy->vdso = maps->vdso;
 
+    copy->maps = malloc(maps->count * sizeof(*copy->maps));
+    if (maps->count && copy->maps == NULL)
+        goto fail;
+    for (; copy->count < maps->count; copy->count++)
+    {
+        copy->maps[copy->count] = maps->maps[copy->count];
+        copy->maps[copy->count].file = strdup(maps->maps[copy->count].file);
+        if (copy->maps[copy->count].file == NULL)
+            goto fail;
     }
+    return copy;
 
-    /* We shouldn't break out of the loop without an error. */
-    if (!status)
-        status = -pte_internal;
+fail:
+    printf("Error: copying mappings");
+    free_proc_maps(copy);
+    return NULL;
+}
 
-    /* We're done when we reach the end of the trace stream. */
-    if (status == -pte_eos)
-    {
-        printf("Error with end of trace stream\n");
+static void free_proc_maps(struct proc_maps *maps)
+{
+    if (maps == NULL)
+        return;
+    free_mappings(maps->maps, maps->count);
+    free(maps);
+}
+
+/*
+ * Bring the image of `ctx' in line with the executable mappings of its
+ * process: the executable, the dynamic loader, shared libraries and the
+ * vdso. Only new mappings have their return sites and function entries
+ * collected. libipt can't take a section out of an image by address, so if
+ * any mapping went away the image is emptied and filled again, from the
+ * section cache.
+ *
+ * The process must be stopped.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool load_process_maps(struct inst_decoder_ctx *ctx)
+{
+    struct proc_maps *maps = ctx->maps;
+    struct proc_mapping *cur;
+    bool removed = false;
+    int loaded = 0;
+
+    int count = read_maps(maps->pid, &cur);
+    if (count < 0)
         return false;
+
+    for (int i = 0; i < maps->count; i++)
+    {
+        struct proc_mapping *old = &maps->maps[i];
+        if (has_mapping(cur, count, old))
+            continue;
+        removed = true;
+        if (ctx->ret_sites != NULL)
+            ret_sites_remove(ctx->ret_sites, old->start, old->end - old->start);
+        if (ctx->func_entries != NULL)
+            func_entries_remove(ctx->func_entries, old->start, old->end - old->start);
+    }
+    if (removed)
+    {
+        pt_image_remove_by_asid(ctx->image, NULL);
+        branch_cache_clear(ctx);
+    }
+    maps->vdso = 0ull;
+
+    for (int i = 0; i < count; i++)
+    {
+        bool known = has_mapping(maps->maps, maps->count, &cur[i]);
+        uint64_t size = cur[i].end - cur[i].start;
+        int errcode = 0;
+
+        if (strcmp(cur[i].file, "[vdso]") == 0)
+            errcode = load_vdso(ctx, cur[i].start, size, known);
+        else if (!known)
+            errcode = add_image_section(ctx, cur[i].file, cur[i].offset, size,
+                                        cur[i].start);
+        else if (removed)
+            errcode = load_section(ctx->iscache, ctx->image, cur[i].file,
+                                   cur[i].offset, size, cur[i].start);
+
+        if (errcode < 0)
+            printf("warning: %s: %s\n", cur[i].file, pt_errstr(pt_errcode(errcode)));
+        else
+            loaded++;
     }
 
+    free_mappings(maps->maps, maps->count);
+    maps->maps = cur;
+    maps->count = count;
+    maps->stale = false;
 
-    if (!exec_flow_analysis(execInst, counter))
+    if (loaded == 0)
     {
-        printf("Rop chain detected\n");
+        printf("Error: no code mapped by %d\n", maps->pid);
         return false;
     }
-    else
+    return true;
+}
+
+/*
+ * Add `size' bytes of `file' from `offset' to the image at `vaddr', and their
+ * return sites and function entries if they are tracked.
+ *
+ * Returns the libipt status of adding the section.
+ */
+static int add_image_section(struct inst_decoder_ctx *ctx, const char *file,
+                             uint64_t offset, uint64_t size, uint64_t vaddr)
+{
+    int errcode = load_section(ctx->iscache, ctx->image, file, offset, size, vaddr);
+    // The section may replace code the cache has seen.
+    if (errcode >= 0)
+        branch_cache_clear(ctx);
+    if (errcode >= 0 && ctx->ret_sites != NULL &&
+        !ret_sites_add_file(ctx->ret_sites, file, offset, size, vaddr))
+        printf("warning: %s: no return sites\n", file);
+    if (errcode >= 0 && ctx->func_entries != NULL &&
+        !func_entries_add_file(ctx->func_entries, file, offset, size, vaddr))
+        printf("warning: %s: no function entries\n", file);
+    return errcode;
+}
+
+/*
+ * Add the executable mappings in `maps', reported by the kernel while the
+ * tracee ran, to the image. A mapping replaces whatever it overlaps.
+ */
+void apply_mmaps(struct inst_decoder_ctx *ctx, struct perf_mmap *maps)
+{
+    for (struct perf_mmap *map = maps; map != NULL; map = map->next)
     {
-        if (stats->psyscall)
-        {
-            printf("Syscall safe\n");
-        }
+        int errcode = add_image_section(ctx, map->filename, map->pgoff,
+                                        map->len, map->addr);
+        if (errcode < 0)
+            printf("warning: %s: %s\n", map->filename,
+                   pt_errstr(pt_errcode(errcode)));
     }
-    return true;
 }
 
 /*
- * Free an instruction decoder and its image.
+ * Take the mappings made up to the current window of `tracer' into the image.
+ */
+static void apply_window_mmaps(struct perf_ctx *tracer, struct inst_decoder_ctx *ctx)
+{
+    apply_mmaps(ctx, tracer->window_mmaps);
+    perf_free_mmaps(tracer->window_mmaps);
+    tracer->window_mmaps = NULL;
+}
+
+/*
+ * Get ready to retrieve instructions from the PT trace of the running
+ * process `pid', which must be stopped.
+ *
+ * The image is built from the process' current mappings rather than from
+ * its executable, so code of shared libraries is found too, and follows
+ * them as they change, see watch_mappings(). `iscache` is shared as for
+ * alloc_inst_decoder().
+ *
+ * Returns a pointer to a decoder context or NULL on error.
  */
-void free_insn_decoder(struct pt_insn_decoder *decoder)
+struct inst_decoder_ctx *
+attach_inst_decoder(pid_t pid, struct pt_image_section_cache *iscache,
+                    struct stats_config *stats)
 {
-    if (decoder != NULL)
+    struct inst_decoder_ctx *ctx = alloc_inst_decoder(iscache, stats);
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->maps = calloc(1, sizeof(*ctx->maps));
+    if (ctx->maps == NULL)
+    {
+        printf("Error: allocating mappings");
+        free_insn_decoder(ctx);
+        return NULL;
+    }
+    ctx->maps->pid = pid;
+
+    if (pt_image_set_callback(ctx->image, read_vdso, ctx->maps) < 0 ||
+        !load_process_maps(ctx))
+    {
+        free_insn_decoder(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/*
+ * System call `nr' is about to run in the process of `ctx'. If it may change
+ * the process' mappings, they are read again before the next window is
+ * decoded, see refresh_inst_decoder().
+ */
+void watch_mappings(struct inst_decoder_ctx *ctx, long nr)
+{
+    if (ctx->maps == NULL)
+        return;
+
+    switch (nr)
+    {
+    case SYS_mmap:
+    case SYS_munmap:
+    case SYS_mremap:
+    case SYS_mprotect:
+    case SYS_pkey_mprotect:
+    case SYS_execve:
+    case SYS_execveat:
+        ctx->maps->stale = true;
+        break;
+    }
+}
+
+/*
+ * Has the image of `ctx' to be read again before decoding?
+ */
+bool inst_decoder_stale(struct inst_decoder_ctx *ctx)
+{
+    return ctx->maps != NULL && ctx->maps->stale;
+}
+
+/*
+ * Read the mappings of the process of `ctx' again if they may have changed.
+ * Its image is shared, so no other thread may be decoding with it. The
+ * process must be stopped.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool refresh_inst_decoder(struct inst_decoder_ctx *ctx)
+{
+    if (!inst_decoder_stale(ctx))
+        return true;
+    return load_process_maps(ctx);
+}
+
+/*
+ * Get a decoder context for another thread of the same process.
+ *
+ * Threads share an address space, so the new context uses the image of
+ * `parent`, which must be freed last.
+ *
+ * Returns a pointer to a decoder context or NULL on error.
+ */
+struct inst_decoder_ctx *share_inst_decoder(struct inst_decoder_ctx *parent)
+{
+    struct inst_decoder_ctx *ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL)
+    {
+        printf("Error: allocating decoder context");
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->config = parent->config;
+    ctx->image = parent->image;
+    ctx->iscache = parent->iscache;
+    ctx->ret_sites = parent->ret_sites;
+    ctx->func_entries = parent->func_entries;
+    ctx->maps = parent->maps;
+    ctx->branch_cache = parent->branch_cache;
+    ctx->use_insn = parent->use_insn;
+    ctx->status = -pte_eos;
+    ctx->owns_image = false;
+    ctx->owns_iscache = false;
+    if (!flow_ring_init(&ctx->ring, parent->ring.limit))
+    {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/*
+ * Get a decoder context for process `pid`, forked from the one `parent`
+ * decodes.
+ *
+ * The child starts with a copy of the parent's address space, so its image
+ * starts as a copy of the parent's. Sections come from the same cache. It
+ * returns through the frames of the thread that forked it, decoded by
+ * `forker`; if that isn't known, it starts with no open calls.
+ *
+ * Returns a pointer to a decoder context or NULL on error.
+ */
+struct inst_decoder_ctx *fork_inst_decoder(struct inst_decoder_ctx *parent,
+                                           struct inst_decoder_ctx *forker, pid_t pid)
+{
+    struct inst_decoder_ctx *ctx = share_inst_decoder(parent);
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->image = pt_image_alloc(NULL);
+    ctx->ret_sites = NULL;
+    ctx->func_entries = NULL;
+    ctx->maps = NULL;
+    ctx->branch_cache = NULL;
+    ctx->owns_image = true;
+    // The child returns through the same frames as the forking thread.
+    if (forker != NULL)
+        ctx->flow = forker->flow;
+    if (ctx->image == NULL || pt_image_copy(ctx->image, parent->image) < 0)
+    {
+        printf("Error: copying image");
+        free_insn_decoder(ctx);
+        return NULL;
+    }
+    if (parent->ret_sites != NULL)
+    {
+        ctx->ret_sites = ret_sites_copy(parent->ret_sites);
+        if (ctx->ret_sites == NULL)
+        {
+            free_insn_decoder(ctx);
+            return NULL;
+        }
+    }
+    if (parent->func_entries != NULL)
+    {
+        ctx->func_entries = func_entries_copy(parent->func_entries);
+        if (ctx->func_entries == NULL)
+        {
+            free_insn_decoder(ctx);
+            return NULL;
+        }
+    }
+    if (parent->branch_cache != NULL)
+    {
+        ctx->branch_cache = calloc(BRANCH_CACHE_SIZE, sizeof(*ctx->branch_cache));
+        if (ctx->branch_cache == NULL)
+        {
+            printf("Error: allocating branch cache");
+            free_insn_decoder(ctx);
+            return NULL;
+        }
+    }
+    // Copies of an image don't keep its callback.
+    if (parent->maps != NULL)
+    {
+        ctx->maps = copy_proc_maps(parent->maps, pid);
+        if (ctx->maps == NULL ||
+            pt_image_set_callback(ctx->image, read_vdso, ctx->maps) < 0)
+        {
+            free_insn_decoder(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+/*
+ * Point the decoder at a new window of trace `buf` of length `len`.
+ *
+ * The previous window's decoder is discarded. The new one is synchronised to
+ * the first PSB in the window and `ctx->status` is updated to reflect its
+ * status. A window without any PSB leaves the context without a decoder,
+ * which decode_trace() treats as an empty window.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool set_decoder_window(struct inst_decoder_ctx *ctx, void *buf, uint64_t len)
+{
+    int rv;
+
+    free_window_decoder(ctx);
+    ctx->status = -pte_eos;
+    ctx->sync_offset = 0ull;
+
+    if (len == 0)
+        return true;
+
+    ctx->config.begin = buf;
+    ctx->config.end = buf + len;
+
+    // Instantiate a decoder.
+    if (ctx->use_insn)
+        ctx->decoder = pt_insn_alloc_decoder(&ctx->config);
+    else
+        ctx->blk_decoder = pt_blk_alloc_decoder(&ctx->config);
+    if (ctx->decoder == NULL && ctx->blk_decoder == NULL)
+    {
+        printf("Error: instantiating decoder");
+        return false;
+    }
+
+    if (ctx->use_insn)
+        rv = pt_insn_set_image(ctx->decoder, ctx->image);
+    else
+        rv = pt_blk_set_image(ctx->blk_decoder, ctx->image);
+    if (rv < 0)
+    {
+        printf("Error: setting image to decoder");
+        free_window_decoder(ctx);
+        return false;
+    }
+
+    // Sync the decoder.
+    ctx->status = decoder_sync_forward(ctx);
+    if (ctx->status == -pte_eos)
+    {
+        // There were no PSBs in the window. Keep it all for the next one.
+        free_window_decoder(ctx);
+        return true;
+    }
+    // Any other error is resynced from by decode_trace().
+    return true;
+}
+
+/*
+ * Free the decoder of the current window, if any.
+ */
+static void free_window_decoder(struct inst_decoder_ctx *ctx)
+{
+    if (ctx->decoder != NULL)
+        pt_insn_free_decoder(ctx->decoder);
+    if (ctx->blk_decoder != NULL)
+        pt_blk_free_decoder(ctx->blk_decoder);
+    ctx->decoder = NULL;
+    ctx->blk_decoder = NULL;
+}
+
+// Whichever decoder the window has, see set_decoder_window().
+static int decoder_sync_forward(struct inst_decoder_ctx *ctx)
+{
+    if (ctx->use_insn)
+        return pt_insn_sync_forward(ctx->decoder);
+    return pt_blk_sync_forward(ctx->blk_decoder);
+}
+
+static int decoder_get_offset(struct inst_decoder_ctx *ctx, uint64_t *offset)
+{
+    if (ctx->use_insn)
+        return pt_insn_get_offset(ctx->decoder, offset);
+    return pt_blk_get_offset(ctx->blk_decoder, offset);
+}
+
+static int decoder_get_sync_offset(struct inst_decoder_ctx *ctx, uint64_t *offset)
+{
+    if (ctx->use_insn)
+        return pt_insn_get_sync_offset(ctx->decoder, offset);
+    return pt_blk_get_sync_offset(ctx->blk_decoder, offset);
+}
+
+/*
+ * Code at `ip' ran next, so it is the target of the last return or indirect
+ * branch if that has none yet: entry `pending' of this window, or the return
+ * ending the previous one.
+ */
+static void return_target(struct inst_decoder_ctx *ctx, struct flow_entry **pending,
+                          uint64_t ip)
+{
+    if (ctx->first_ip == 0ull)
+        ctx->first_ip = ip;
+    if (*pending != NULL)
+    {
+        (*pending)->target = ip;
+        if (!ctx->deferred)
+            check_target(ctx, *pending);
+    }
+    else if (ctx->flow.ret_pending)
+        check_return(ctx, ctx->flow.last_ip, ip);
+    *pending = NULL;
+    ctx->flow.ret_pending = false;
+}
+
+/*
+ * Record the branch at `ip' in the window, and the call it opens if any.
+ *
+ * Returns its entry, or NULL if there is no room.
+ */
+static struct flow_entry *record_branch(struct inst_decoder_ctx *ctx, uint64_t ip,
+                                        enum pt_insn_class iclass, uint32_t ninsn)
+{
+    struct flow_entry *entry = flow_ring_push(&ctx->ring);
+    if (entry == NULL)
+        return NULL;
+
+    if (iclass == ptic_call && !ctx->deferred)
+        flow_ras_push(&ctx->flow, ip);
+    entry->ip = ip;
+    entry->target = 0ull;
+    entry->insn = ninsn;
+    entry->iclass = iclass;
+    entry->ret = FLOW_RET_PENDING;
+    entry->indirect = iclass == ptic_indirect || iclass == ptic_far_call ||
+                      iclass == ptic_far_jump;
+    return entry;
+}
+
+/*
+ * Does a branch of class `iclass', ending a run of `ninsn' instructions,
+ * have to be told direct or indirect? Only --entries and --gadgets look.
+ */
+static bool need_indirect(struct stats_config *stats, enum pt_insn_class iclass,
+                          uint32_t ninsn)
+{
+    if (iclass == ptic_call)
+        return stats->entries;
+    if (iclass == ptic_jump)
+        return stats->entries ||
+               (stats->gadget_chain > 0 && ninsn <= (uint32_t)stats->gadget_size);
+    return false;
+}
+
+/*
+ * Is the instruction in `raw' a near call or jump through a register or
+ * memory? libipt doesn't tell them from direct ones.
+ */
+static bool indirect_branch(const uint8_t *raw, uint8_t size)
+{
+    xed_state_t xed;
+    xed_decoded_inst_t inst;
+
+    xed_state_init2(&xed, XED_MACHINE_MODE_LONG_64, XED_ADDRESS_WIDTH_64b);
+    xed_decoded_inst_zero_set_mode(&inst, &xed);
+    if (xed_decode(&inst, raw, size) != XED_ERROR_NONE)
+        return false;
+
+    xed_iclass_enum_t iclass = xed_decoded_inst_get_iclass(&inst);
+    return (iclass == XED_ICLASS_JMP || iclass == XED_ICLASS_CALL_NEAR) &&
+           xed_decoded_inst_get_branch_displacement_width(&inst) == 0;
+}
+
+/*
+ * Look up the branch at `ip' in the cache of its image.
+ *
+ * Returns 1 if it is indirect, 0 if it is direct, or -1 if it isn't cached.
+ */
+static int branch_cache_get(struct inst_decoder_ctx *ctx, uint64_t ip)
+{
+    if (ctx->branch_cache == NULL)
+        return -1;
+
+    // Segments of a window look it up from their own threads.
+    uint64_t *slot = &ctx->branch_cache[(ip ^ (ip >> 14)) & (BRANCH_CACHE_SIZE - 1)];
+    uint64_t entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if (entry == 0ull || entry >> 1 != ip)
+        return -1;
+    return entry & 1;
+}
+
+/*
+ * Remember whether the branch at `ip' is indirect, evicting whatever branch
+ * shared its slot.
+ */
+static void branch_cache_put(struct inst_decoder_ctx *ctx, uint64_t ip, bool indirect)
+{
+    if (ctx->branch_cache == NULL)
+        return;
+
+    uint64_t *slot = &ctx->branch_cache[(ip ^ (ip >> 14)) & (BRANCH_CACHE_SIZE - 1)];
+    __atomic_store_n(slot, ip << 1 | indirect, __ATOMIC_RELAXED);
+}
+
+/*
+ * Forget every cached branch, as the code of the image changed. Only called
+ * between windows.
+ */
+static void branch_cache_clear(struct inst_decoder_ctx *ctx)
+{
+    if (ctx->branch_cache != NULL)
+        memset(ctx->branch_cache, 0, BRANCH_CACHE_SIZE * sizeof(*ctx->branch_cache));
+}
+
+/*
+ * indirect_branch() for the instruction at `ip', through the branch cache:
+ * XED only decodes the first time a branch is seen.
+ */
+static bool cached_indirect_branch(struct inst_decoder_ctx *ctx, uint64_t ip,
+                                   const uint8_t *raw, uint8_t size)
+{
+    int known = branch_cache_get(ctx, ip);
+    if (known >= 0)
+        return known;
+
+    bool indirect = indirect_branch(raw, size);
+    branch_cache_put(ctx, ip, indirect);
+    return indirect;
+}
+
+/*
+ * Is the branch ending `block' indirect? Its bytes are only in the block if
+ * it was cut short, otherwise they come from the section cache. Branches
+ * seen before are answered from the branch cache without reading them.
+ */
+static bool block_indirect_branch(struct inst_decoder_ctx *ctx,
+                                  const struct pt_block *block)
+{
+    uint8_t raw[pt_max_insn_size];
+    int size;
+
+    int known = branch_cache_get(ctx, block->end_ip);
+    if (known >= 0)
+        return known;
+
+    if (block->truncated)
+        return cached_indirect_branch(ctx, block->end_ip, block->raw, block->size);
+
+    // Code in no section, the vdso, comes through the image callback.
+    if (block->isid > 0)
+        size = pt_iscache_read(ctx->iscache, raw, sizeof(raw), block->isid, block->end_ip);
+    else if (ctx->maps != NULL)
+        size = read_vdso(raw, sizeof(raw), NULL, block->end_ip, ctx->maps);
+    else
+        size = -pte_nomap;
+    return size > 0 && cached_indirect_branch(ctx, block->end_ip, raw, size);
+}
+
+/*
+ * Check the return at `ip' to `target' against the shadow stack. With an
+ * empty one, nothing says which call it returns from, so with --retcheck it
+ * must at least land right after some call.
+ *
+ * Returns what the return matched.
+ */
+static enum flow_ret check_return(struct inst_decoder_ctx *ctx, uint64_t ip,
+                                  uint64_t target)
+{
+    enum flow_ret ret = flow_return(&ctx->flow, ip, target);
+
+    if (ret == FLOW_RET_UNMATCHED && ctx->flow.ras_depth == 0 &&
+        ctx->ret_sites != NULL && !ret_sites_contains(ctx->ret_sites, target))
+    {
+        ctx->flow.mismatches++;
+        if (stats.pinfo)
+            printf("return 0x%" PRIx64 " to 0x%" PRIx64 " follows no call\n", ip,
+                   target);
+    }
+    return ret;
+}
+
+/*
+ * Check the return or indirect branch `entry' now that its target is known:
+ * returns against the shadow stack, calls and jumps against the function
+ * entries.
+ */
+static void check_target(struct inst_decoder_ctx *ctx, struct flow_entry *entry)
+{
+    bool ok;
+
+    if (entry->iclass == ptic_return)
+    {
+        entry->ret = check_return(ctx, entry->ip, entry->target);
+        return;
+    }
+    if (ctx->func_entries == NULL || !entry->indirect)
+        return;
+
+    switch (entry->iclass)
+    {
+    case ptic_far_call:
+        // A syscall comes back right after itself.
+        if (entry->target > entry->ip && entry->target - entry->ip <= MAX_CALL_SIZE)
+            return;
+        // Fall through.
+    case ptic_call:
+        ok = func_entries_contains(ctx->func_entries, entry->target);
+        break;
+    default:
+        // Jumps may stay in their function too, e.g. through a switch table.
+        ok = func_entries_contains(ctx->func_entries, entry->target) ||
+             func_entries_same_function(ctx->func_entries, entry->ip, entry->target);
+        break;
+    }
+
+    if (!ok)
+    {
+        ctx->flow.stray_targets++;
+        if (stats.pinfo)
+            printf("branch 0x%" PRIx64 " to 0x%" PRIx64 " enters no function\n",
+                   entry->ip, entry->target);
+    }
+}
+
+/*
+ * Drop the analysis state carried from earlier windows.
+ */
+static void forget_flow(struct inst_decoder_ctx *ctx)
+{
+    memset(&ctx->flow, 0, sizeof(ctx->flow));
+    ctx->ret_run = 0;
+    ctx->seen = 0;
+}
+
+/*
+ * Skip to the next PSB after decoding failed with `errcode', and account the
+ * trace in between as lost.
+ *
+ * Returns the decoder status at the new PSB, or a negative error code if
+ * there is none.
+ */
+static int resync_decoder(struct inst_decoder_ctx *ctx, int errcode,
+                          struct stats_config *stats)
+{
+    uint64_t from = 0ull, to;
+    int status;
+
+    decoder_get_offset(ctx, &from);
+    status = decoder_sync_forward(ctx);
+    if (status < 0 || decoder_get_sync_offset(ctx, &to) < 0)
+    {
+        // Nothing left to decode in this window.
+        status = -pte_eos;
+        to = ctx->config.end - ctx->config.begin;
+    }
+
+    ctx->gaps++;
+    if (to > from)
+        ctx->lost_bytes += to - from;
+    // Whatever the last return went to is lost too.
+    ctx->flow.ret_pending = false;
+    if (stats->pinfo)
+        printf("trace gap 0x%" PRIx64 "-0x%" PRIx64 " after ip 0x%" PRIx64 ": %s\n",
+               from, to, ctx->flow.last_ip, pt_errstr(pt_errcode(errcode)));
+    return status;
+}
+
+/*
+ * Decode the window instruction by instruction, printing them for --pinst
+ * and --praw, and record its branches in `ctx->ring'.
+ */
+static void decode_insns(struct inst_decoder_ctx *ctx, struct stats_config *stats,
+                         int *overflows, uint32_t *ninsn)
+{
+    struct pt_insn_decoder *decoder = ctx->decoder;
+
+    xed_state_t xed;
+    if (stats->pinst)
+    {
+        xed_state_zero(&xed);
+        xed_tables_init();
+    }
+
+    uint64_t offset;
+
+    offset = 0ull;
+    int errcode;
+
+    int status = ctx->status;
+    struct pt_insn insn;
+
+    // The last return, until its target is decoded.
+    struct flow_entry *pending = NULL;
+
+    /* Initialize the IP - we use it for error reporting. */
+    insn.ip = 0ull;
+
+    for (;;)
+    {
+        // On errors, pick up again at the next PSB. The end of the window
+        // is the only way out.
+        if (status < 0)
+        {
+            if (status == -pte_eos)
+                break;
+            status = resync_decoder(ctx, status, stats);
+            pending = NULL;
+            continue;
+        }
+
+        status = drain_events_insn(decoder, status, overflows);
+        if (status < 0)
+            continue;
+
+        if (status & pts_eos)
+        {
+            // printf("[End of trace]\n");
+            break;
+        }
+
+        errcode = pt_insn_get_offset(decoder, &offset);
+        if (errcode < 0)
+        {
+            status = errcode;
+            continue;
+        }
+
+        status = pt_insn_next(decoder, &insn, sizeof(insn));
+        if (status < 0)
+        {
+            if (stats->pinst && status != -pte_eos)
+            {
+                /* Even in case of errors, we may have succeeded
+                 * in decoding the current instruction.
+                 */
+                print_insn(&insn, &xed, offset);
+                printf("Error fetching instruction\n");
+            }
+            continue;
+        }
+
+        // Decoded again to get back in sync, but already analysed with
+        // the previous window.
+        if (offset < ctx->seen)
+            continue;
+
+        return_target(ctx, &pending, insn.ip);
+        (*ninsn)++;
+        if (insn.iclass != ptic_other)
+        {
+            struct flow_entry *entry = record_branch(ctx, insn.ip, insn.iclass,
+                                                     *ninsn);
+            if (entry != NULL && need_indirect(stats, insn.iclass, 1))
+                entry->indirect = cached_indirect_branch(ctx, insn.ip, insn.raw,
+                                                         insn.size);
+            if (entry != NULL && (insn.iclass == ptic_return || entry->indirect))
+                pending = entry;
+        }
+
+        if (stats->pinst)
+            print_insn(&insn, &xed, offset);
+
+        if (stats->praw)
+            print_raw_insn_file(&insn);
+
+    }
+}
+
+/*
+ * Decode the window block by block and record the branch that ends each
+ * block in `ctx->ring'. Blocks may also end at events or section boundaries,
+ * without a branch.
+ */
+static void decode_blocks(struct inst_decoder_ctx *ctx, struct stats_config *stats,
+                          int *overflows, uint32_t *ninsn)
+{
+    struct pt_block_decoder *decoder = ctx->blk_decoder;
+    int status = ctx->status;
+    struct pt_block block;
+    uint64_t offset = 0ull;
+    struct flow_entry *entry, *pending = NULL;
+
+    for (;;)
+    {
+        // Errors are handled as for decode_insns().
+        if (status < 0)
+        {
+            if (status == -pte_eos)
+                break;
+            status = resync_decoder(ctx, status, stats);
+            pending = NULL;
+            continue;
+        }
+
+        status = drain_events_blk(decoder, status, overflows);
+        if (status < 0)
+            continue;
+
+        if (status & pts_eos)
+            break;
+
+        status = pt_blk_get_offset(decoder, &offset);
+        if (status < 0)
+            continue;
+
+        // Even in case of errors, the block holds the instructions decoded
+        // up to the error.
+        block.ninsn = 0;
+        status = pt_blk_next(decoder, &block, sizeof(block));
+        if (block.ninsn == 0 || offset < ctx->seen)
+            continue;
+
+        return_target(ctx, &pending, block.ip);
+        *ninsn += block.ninsn;
+        if (status < 0 || block.iclass == ptic_other ||
+            block.iclass == ptic_unknown)
+            continue;
+
+        entry = record_branch(ctx, block.end_ip, block.iclass, *ninsn);
+        if (entry != NULL && need_indirect(stats, block.iclass, block.ninsn))
+            entry->indirect = block_indirect_branch(ctx, &block);
+        if (entry != NULL && (block.iclass == ptic_return || entry->indirect))
+            pending = entry;
+    }
+}
+
+/*
+ * Body of a segment thread: decode one segment into its own entries.
+ */
+static void *decode_segment(void *arg)
+{
+    struct decode_segment *seg = arg;
+
+    if (set_decoder_window(seg->ctx, seg->buf, seg->len) &&
+        seg->ctx->blk_decoder != NULL)
+        decode_blocks(seg->ctx, seg->stats, &seg->overflows, &seg->ninsn);
+    return NULL;
+}
+
+/*
+ * Decode a big window on up to `stats->jobs' threads at once, and merge
+ * their branches into `ctx->ring' in trace order.
+ *
+ * The window is cut at the first PSB after every 1/jobs-th of it, so every
+ * segment can be decoded on its own. Each thread gets a copy of the image:
+ * the sections and their code are shared through the section cache, but
+ * libipt reorders an image's section list on lookups.
+ */
+static void decode_segments(struct inst_decoder_ctx *ctx, struct stats_config *stats,
+                            int *overflows, uint32_t *ninsn)
+{
+    struct decode_segment segs[MAX_JOBS];
+    uint64_t len = ctx->config.end - ctx->config.begin;
+    uint64_t start = 0ull;
+    struct flow_entry *pending = NULL;
+    int nsegs = 0;
+
+    int jobs = stats->jobs < MAX_JOBS ? stats->jobs : MAX_JOBS;
+    if (len / PARALLEL_MIN_SEGMENT < (uint64_t)jobs)
+        jobs = len / PARALLEL_MIN_SEGMENT;
+
+    struct pt_packet_decoder *pkt = pt_pkt_alloc_decoder(&ctx->config);
+    if (pkt == NULL)
+    {
+        decode_blocks(ctx, stats, overflows, ninsn);
+        return;
+    }
+
+    memset(segs, 0, sizeof(segs));
+    for (int i = 1; i <= jobs; i++)
+    {
+        uint64_t end = len;
+
+        if (i < jobs)
+        {
+            if (pt_pkt_sync_set(pkt, len / jobs * i) < 0 ||
+                pt_pkt_sync_forward(pkt) < 0 ||
+                pt_pkt_get_sync_offset(pkt, &end) < 0)
+                end = len;
+            if (end <= start)
+                continue;
+        }
+
+        struct decode_segment *seg = &segs[nsegs];
+        seg->ctx = malloc(sizeof(*seg->ctx));
+        if (seg->ctx != NULL)
+        {
+            *seg->ctx = *ctx;
+            seg->ctx->decoder = NULL;
+            seg->ctx->blk_decoder = NULL;
+            seg->ctx->ring.entry = NULL;
+            seg->ctx->image = pt_image_alloc(NULL);
+        }
+        if (seg->ctx == NULL || seg->ctx->image == NULL ||
+            pt_image_copy(seg->ctx->image, ctx->image) < 0 ||
+            (ctx->maps != NULL &&
+             pt_image_set_callback(seg->ctx->image, read_vdso, ctx->maps) < 0) ||
+            !flow_ring_init(&seg->ctx->ring, FLOW_RING_DEFAULT))
+        {
+            printf("Error: allocating decoder segment");
+            if (seg->ctx != NULL && seg->ctx->image != NULL)
+                pt_image_free(seg->ctx->image);
+            free(seg->ctx);
+            seg->ctx = NULL;
+            break;
+        }
+        // Everything is merged into `ctx->ring', which retires in order.
+        seg->ctx->ring.grow = true;
+        seg->ctx->deferred = true;
+
+        memset(&seg->ctx->flow, 0, sizeof(seg->ctx->flow));
+        seg->ctx->seen = ctx->seen > start ? ctx->seen - start : 0;
+        seg->ctx->first_ip = 0ull;
+        seg->ctx->gaps = 0;
+        seg->ctx->lost_bytes = 0;
+        seg->buf = (void *)ctx->config.begin + start;
+        seg->len = end - start;
+        seg->stats = stats;
+        nsegs++;
+        start = end;
+        if (end == len)
+            break;
+    }
+    pt_pkt_free_decoder(pkt);
+
+    // Without at least two segments, or if the last one is missing, decode
+    // the window the usual way.
+    bool parallel = nsegs > 1 && start == len;
+    int nthreads = 0;
+    while (parallel && nthreads < nsegs)
+    {
+        if (pthread_create(&segs[nthreads].thread, NULL, decode_segment,
+                           &segs[nthreads]) != 0)
+        {
+            // Decode whatever is left here.
+            printf("Error: spawning decoder thread");
+            for (int i = nthreads; i < nsegs; i++)
+                decode_segment(&segs[i]);
+            break;
+        }
+        nthreads++;
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(segs[i].thread, NULL);
+
+    if (!parallel)
+        decode_blocks(ctx, stats, overflows, ninsn);
+
+    for (int i = 0; i < nsegs; i++)
+    {
+        struct decode_segment *seg = &segs[i];
+
+        if (parallel)
+        {
+            // The first IP of a segment is what the return ending the
+            // previous one, or the previous window, went to.
+            if (seg->ctx->first_ip != 0ull)
+                return_target(ctx, &pending, seg->ctx->first_ip);
+
+            // The segment started with an empty shadow stack, so replay its
+            // calls and returns on the thread's.
+            for (uint32_t j = 0; j < seg->ctx->ring.count; j++)
+            {
+                struct flow_entry *entry = flow_ring_push(&ctx->ring);
+                *entry = *flow_ring_at(&seg->ctx->ring, j);
+                entry->insn += *ninsn;
+                if (entry->iclass == ptic_call)
+                    flow_ras_push(&ctx->flow, entry->ip);
+                if (entry->iclass != ptic_return && !entry->indirect)
+                    continue;
+                if (entry->target == 0ull)
+                    pending = entry;
+                else
+                    check_target(ctx, entry);
+            }
+            *ninsn += seg->ninsn;
+            *overflows += seg->overflows;
+            ctx->gaps += seg->ctx->gaps;
+            ctx->lost_bytes += seg->ctx->lost_bytes;
+        }
+
+        free_window_decoder(seg->ctx);
+        pt_image_free(seg->ctx->image);
+        flow_ring_free(&seg->ctx->ring);
+        free(seg->ctx);
+    }
+}
+
+/*
+ * Check where the window's returns go against the return sites of the image.
+ * The block decoder tells returns apart from indirect calls and jumps by the
+ * instruction ending each block, and the next block starts at the target.
+ * Nothing else is analysed, and the first `seen' bytes, which the previous
+ * window checked already, are only decoded to get in sync.
+ *
+ * Every legitimate return lands on a return site, so a long run of returns
+ * that follow no call is a chain of returns into gadgets. A run carries on
+ * from one window to the next.
+ *
+ * Returns the longest such run in the window.
+ */
+static int check_returns(struct inst_decoder_ctx *ctx, uint64_t seen)
+{
+    struct pt_block_decoder *decoder;
+    struct pt_block block;
+    struct pt_event event;
+    uint64_t offset = 0ull;
+    bool ret = false;
+    int status, run = ctx->ret_run, longest = ctx->ret_run;
+
+    if (ctx->ret_sites == NULL)
+        return 0;
+
+    decoder = pt_blk_alloc_decoder(&ctx->config);
+    if (decoder == NULL || pt_blk_set_image(decoder, ctx->image) < 0)
+    {
+        printf("Error: instantiating block decoder");
+        if (decoder != NULL)
+            pt_blk_free_decoder(decoder);
+        return 0;
+    }
+
+    status = pt_blk_sync_forward(decoder);
+    while (status != -pte_eos)
+    {
+        if (status < 0)
+        {
+            // Pick up again at the next PSB, no run spans the gap.
+            run = 0;
+            ret = false;
+            status = pt_blk_sync_forward(decoder);
+            continue;
+        }
+
+        if (status & pts_event_pending)
+        {
+            status = pt_blk_event(decoder, &event, sizeof(event));
+            if (status >= 0 && (event.type == ptev_overflow ||
+                                event.type == ptev_disabled ||
+                                event.type == ptev_async_disabled))
+            {
+                run = 0;
+                ret = false;
+            }
+            continue;
+        }
+
+        if (status & pts_eos)
+            break;
+
+        status = pt_blk_get_offset(decoder, &offset);
+        if (status < 0)
+            continue;
+
+        block.ninsn = 0;
+        status = pt_blk_next(decoder, &block, sizeof(block));
+        if (block.ninsn == 0)
+            continue;
+
+        // The block starts where the return ending the last one went.
+        if (ret && offset >= seen)
+        {
+            if (ret_sites_contains(ctx->ret_sites, block.ip))
+                run = 0;
+            else if (++run > longest)
+                longest = run;
+        }
+        ret = status >= 0 && block.iclass == ptic_return;
+    }
+
+    pt_blk_free_decoder(decoder);
+    ctx->ret_run = run;
+    return longest;
+}
+
+/*
+ *
+ * Decodes intel PT
+ *
+ */
+bool decode_trace(struct inst_decoder_ctx *ctx, struct stats_config *stats)
+{
+    int chain;
+    uint32_t ninsn = 0;
+    int overflows = 0;
+    uint64_t seen = ctx->seen;
+
+    ctx->gaps = 0;
+    ctx->lost_bytes = 0;
+    ctx->insn_count = 0;
+
+    // The event was off from the overflow up to the syscall, see
+    // perf_next_window(), so the end of the window is missing.
+    if (ctx->window_lost)
+    {
+        ctx->gaps++;
+        if (stats->pinfo)
+            printf("trace gap: AUX buffer overflowed\n");
+    }
+
+    // Nothing was traced, or not enough to reach a PSB.
+    if (ctx->decoder == NULL && ctx->blk_decoder == NULL)
+    {
+        if (ctx->gaps > 0 && stats->strict)
+        {
+            printf("Trace incomplete (AUX buffer overflowed)\n");
+            return false;
+        }
+        return true;
+    }
+
+    ctx->first_ip = 0ull;
+    flow_ring_start(&ctx->ring, &ctx->flow);
+    if (ctx->use_insn)
+        decode_insns(ctx, stats, &overflows, &ninsn);
+    else if (stats->jobs > 1 &&
+             ctx->config.end - ctx->config.begin >= PARALLEL_MIN_WINDOW)
+        decode_segments(ctx, stats, &overflows, &ninsn);
+    else
+        decode_blocks(ctx, stats, &overflows, &ninsn);
+
+    // Remember the last PSB in the window, the next window restarts there.
+    ctx->sync_offset = last_psb_offset(&ctx->config);
+    ctx->insn_count = ninsn;
+
+    // The next window gets a new decoder that syncs at this PSB and decodes
+    // the rest of this window again. Only what follows it will be new.
+    ctx->seen = (ctx->config.end - ctx->config.begin) - ctx->sync_offset;
+
+    // The hardware dropped packets, the decoder resumed at the next IP.
+    ctx->gaps += overflows;
+    if (stats->pinfo && overflows)
+        printf("trace gap: %d overflows\n", overflows);
+
+    // A window with gaps is still analysed. Whether what was lost may have
+    // hidden an attack is up to --strict.
+    if (ctx->gaps > 0 && stats->strict)
+    {
+        printf("Trace incomplete (%d gaps, %" PRIu64 " bytes lost)\n",
+               ctx->gaps, ctx->lost_bytes);
+        return false;
+    }
+
+    if (!exec_flow_analysis(&ctx->ring, ninsn, &ctx->flow))
+    {
+        printf("Rop chain detected\n");
+        return false;
+    }
+    else if (stats->gadget_chain > 0 && ctx->flow.longest_chain >= stats->gadget_chain)
+    {
+        printf("Gadget chain of %d detected\n", ctx->flow.longest_chain);
+        return false;
+    }
+    else if (stats->entries && ctx->flow.stray_targets > stats->entries_tolerance)
+    {
+        printf("Jump/call chain detected: %d indirect branches enter no function\n",
+               ctx->flow.stray_targets);
+        return false;
+    }
+    else if (stats->shadow && ctx->flow.mismatches > stats->shadow_tolerance)
+    {
+        printf("Shadow stack mismatch: %d returns to no open call\n",
+               ctx->flow.mismatches);
+        return false;
+    }
+    else if (stats->retcheck && (chain = check_returns(ctx, seen)) >= RET_CHAIN_LIMIT)
+    {
+        printf("Return chain of %d detected\n", chain);
+        return false;
+    }
+    else
+    {
+        if (stats->psyscall)
+        {
+            printf("Syscall safe\n");
+        }
+    }
+    return true;
+}
+
+/*
+ * Decode and analyse the tail of a snapshot ring: only as many PSB periods
+ * before the syscall as it takes to see `stats->depth` instructions. Without
+ * --depth the whole ring is decoded.
+ *
+ * The PSBs are found and the branches counted without decoding, so the
+ * ring is only copied out and decoded once, from the PSB chosen.
+ *
+ * Returns false if an attack was detected, true otherwise.
+ */
+static bool check_snapshot(struct perf_ctx *tracer, struct inst_decoder_ctx *ctx,
+                           struct stats_config *stats)
+{
+    void *window;
+    size_t window_len;
+
+    if (!perf_next_window(tracer, &window, &window_len))
+    {
+        printf("Error: reading AUX buffer\n");
+        return false;
+    }
+    apply_window_mmaps(tracer, ctx);
+
+    // Snapshots overlap by an unknown amount, so every decode starts afresh
+    // instead of carrying on from the previous one.
+    uint64_t start = 0ull;
+    if (!stats->limited)
+        perf_snapshot_fill(tracer, 0);
+    else
+    {
+        // Step back one PSB at a time until the tail holds more branches,
+        // and so more instructions, than asked for.
+        uint64_t branches = 0ull;
+        uint64_t psb;
+
+        start = window_len;
+        while (branches <= (uint64_t)stats->depth &&
+               perf_snapshot_psb(tracer, start, &psb))
+        {
+            branches += count_branches(&ctx->config, window + psb, window + start);
+            start = psb;
+        }
+    }
+
+    forget_flow(ctx);
+    if (!set_decoder_window(ctx, window + start, window_len - start))
+        printf("error: decoder window\n");
+    return decode_trace(ctx, stats);
+}
+
+/*
+ * Decode and analyse the trace `tracer` collected since the last check.
+ *
+ * The tracee must not be running in user space while this is called.
+ *
+ * Returns false if an attack was detected, true otherwise.
+ */
+bool check_window(struct perf_ctx *tracer, struct inst_decoder_ctx *ctx, struct stats_config *stats)
+{
+    void *window;
+    size_t window_len;
+
+    // Failing that, the old image still serves.
+    refresh_inst_decoder(ctx);
+
+    if (tracer->snapshot)
+        return check_snapshot(tracer, ctx, stats);
+
+    // Only decode the trace produced since the last check.
+    if (!perf_next_window(tracer, &window, &window_len))
+    {
+        printf("Error: reading AUX buffer\n");
+        return false;
+    }
+    apply_window_mmaps(tracer, ctx);
+
+    if (!set_decoder_window(ctx, window, window_len))
+        printf("error: decoder window\n");
+
+    ctx->window_lost = tracer->window_lost;
+    bool safe = decode_trace(ctx, stats);
+    if (!safe)
+    {
+        perf_release_window(tracer, window_len);
+        ctx->seen = 0;
+    }
+    // Trace only resumes after the hole, nothing carries on from here.
+    else if (ctx->window_lost)
+    {
+        perf_release_window(tracer, window_len);
+        forget_flow(ctx);
+    }
+    else
+        perf_release_window(tracer, ctx->sync_offset);
+
+    // A resize dropped the trace kept from the last PSB, the next window
+    // doesn't start with the `seen' bytes.
+    if (tracer->tail_dropped)
+    {
+        tracer->tail_dropped = false;
+        forget_flow(ctx);
+    }
+    return safe;
+}
+
+/*
+ * Benchmark the flow analysis against the return check on `dump', an AUX
+ * buffer written by --pbuff while tracing `exe', and print how long each
+ * takes.
+ *
+ * Returns false if either found an attack, true otherwise.
+ */
+bool bench_dump(const char *dump, const char *exe, struct stats_config *stats)
+{
+    struct stats_config flow_stats = *stats;
+    struct inst_decoder_ctx *ctx;
+    void *buf = NULL;
+    long len;
+    clock_t begin;
+    double image_time, flow_time, ret_time;
+    size_t nsites = 0;
+    bool safe = false;
+    int chain;
+
+    FILE *file = fopen(dump, "rb");
+    if (file == NULL)
+    {
+        printf("Error: opening %s\n", dump);
+        return false;
+    }
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) > 0 &&
+        fseek(file, 0, SEEK_SET) == 0)
+    {
+        buf = malloc(len);
+        if (buf != NULL && fread(buf, 1, len, file) != (size_t)len)
+        {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    fclose(file);
+    if (buf == NULL)
+    {
+        printf("Error: reading %s\n", dump);
+        return false;
+    }
+
+    // Always build the return sites, but only run the return check when
+    // timing it on its own.
+    flow_stats.retcheck = true;
+    begin = clock();
+    ctx = init_inst_decoder(exe, NULL, &flow_stats);
+    // The return sites are only built when first looked up.
+    if (ctx != NULL)
+        nsites = ret_sites_count(ctx->ret_sites);
+    image_time = (double)(clock() - begin) / CLOCKS_PER_SEC;
+    flow_stats.retcheck = false;
+    if (ctx == NULL)
+        goto clean;
+
+    if (!set_decoder_window(ctx, buf, len))
+        printf("error: decoder window\n");
+
+    begin = clock();
+    safe = decode_trace(ctx, &flow_stats);
+    flow_time = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    begin = clock();
+    chain = check_returns(ctx, 0);
+    ret_time = (double)(clock() - begin) / CLOCKS_PER_SEC;
+
+    printf("image:         %f second, %zu return sites\n", image_time, nsites);
+    printf("flow analysis: %f second, %d instructions, %s\n", flow_time,
+           ctx->insn_count, safe ? "safe" : "attack");
+    printf("return check:  %f second, longest chain %d, %s\n", ret_time, chain,
+           chain < RET_CHAIN_LIMIT ? "safe" : "attack");
+    safe = safe && chain < RET_CHAIN_LIMIT;
+
+clean:
+    free_insn_decoder(ctx);
+    free(buf);
+    return safe;
+}
+
+/*
+ * Free an instruction decoder and its image.
+ */
+void free_insn_decoder(struct inst_decoder_ctx *ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    free_window_decoder(ctx);
+    if (ctx->owns_image && ctx->image != NULL)
+        pt_image_free(ctx->image);
+    if (ctx->owns_image)
     {
-        pt_insn_free_decoder(decoder);
+        ret_sites_free(ctx->ret_sites);
+        func_entries_free(ctx->func_entries);
+        free_proc_maps(ctx->maps);
+        free(ctx->branch_cache);
     }
+    if (ctx->owns_iscache && ctx->iscache != NULL)
+        pt_iscache_free(ctx->iscache);
+    flow_ring_free(&ctx->ring);
+    free(ctx->carry);
+    free(ctx);
 }
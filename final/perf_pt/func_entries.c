@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Function entries of one executable segment of a file.
+ */
+struct func_segment
+{
+    uint64_t vaddr;     // Where the segment is mapped.
+    uint64_t size;
+    char *file;         // Where its code comes from, until read, or NULL
+                        // if it was given in memory.
+    uint64_t offset;
+    uint64_t *entries;  // Addresses, sorted.
+    size_t count;
+};
+
+/*
+ * The function entries of an image: where indirect calls may go, and where
+ * indirect jumps may go to leave a function.
+ *
+ * Lookups go through all entries at once, in Eytzinger order: the tree is
+ * laid out breadth first, so the first levels of every search share a few
+ * cache lines, and the next ones can be prefetched.
+ */
+struct func_entries
+{
+    struct func_segment *segs; // Sorted by `vaddr', without overlaps.
+    size_t count;
+    size_t capacity;
+    uint64_t *tree;            // Entries of all segments, 1-based.
+    size_t n;
+    bool pending;              // Are some segments not read yet?
+};
+
+// Private prototypes.
+static int compare_entries(const void *, const void *);
+static bool push_entry(struct func_segment *, size_t *, uint64_t);
+static bool scan_elf(struct func_segment *, const uint8_t *, uint64_t, const char *);
+static bool read_segment(struct func_segment *);
+static struct func_segment *insert_entries(struct func_entries *, uint64_t, uint64_t);
+static size_t drop_entries(struct func_entries *, uint64_t, uint64_t);
+static size_t eytzinger(uint64_t *, const uint64_t *, size_t, size_t, size_t);
+static bool func_entries_build(struct func_entries *);
+static uint64_t func_entries_lower_bound(struct func_entries *, uint64_t);
+
+// Public prototypes.
+struct func_entries *func_entries_alloc(void);
+struct func_entries *func_entries_copy(const struct func_entries *);
+bool func_entries_add_file(struct func_entries *, const char *file, uint64_t offset,
+                           uint64_t size, uint64_t vaddr);
+bool func_entries_add_code(struct func_entries *, const char *name, const uint8_t *elf,
+                           uint64_t size, uint64_t vaddr);
+void func_entries_remove(struct func_entries *, uint64_t vaddr, uint64_t size);
+bool func_entries_contains(struct func_entries *, uint64_t ip);
+bool func_entries_same_function(struct func_entries *, uint64_t, uint64_t);
+void func_entries_free(struct func_entries *);
+
+static int compare_entries(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool push_entry(struct func_segment *seg, size_t *capacity, uint64_t ip)
+{
+    if (seg->count == *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity * 2 : 1024;
+        uint64_t *new_entries = realloc(seg->entries, new_capacity * sizeof(*new_entries));
+        if (new_entries == NULL)
+        {
+            printf("Error: growing function entries");
+            return false;
+        }
+        seg->entries = new_entries;
+        *capacity = new_capacity;
+    }
+    seg->entries[seg->count++] = ip;
+    return true;
+}
+
+/*
+ * Collect the function entries of a segment from the symbol tables of `elf',
+ * the `len' bytes of the object `name' it comes from. Without a .symtab that
+ * names functions, e.g. in a stripped file, .dynsym only has the exported
+ * ones, so prologues found in the code are taken as entries too: endbr64,
+ * and push %rbp; mov %rsp,%rbp.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool scan_elf(struct func_segment *seg, const uint8_t *elf, uint64_t len,
+                     const char *name)
+{
+    static const uint8_t endbr64[] = {0xf3, 0x0f, 0x1e, 0xfa};
+    static const uint8_t push_rbp[] = {0x55, 0x48, 0x89, 0xe5};
+    const Elf64_Ehdr *ehdr;
+    const Elf64_Phdr *phdr;
+    const Elf64_Shdr *shdr;
+    size_t capacity = 0;
+    bool symtab = false, ok = false;
+
+    ehdr = (const Elf64_Ehdr *)elf;
+    if (len < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_phoff > len || ehdr->e_phnum * sizeof(*phdr) > len - ehdr->e_phoff ||
+        ehdr->e_shoff > len || ehdr->e_shnum * sizeof(*shdr) > len - ehdr->e_shoff)
+    {
+        printf("warning: %s: not a 64-bit ELF file\n", name);
+        goto clean;
+    }
+    phdr = (const Elf64_Phdr *)(elf + ehdr->e_phoff);
+    shdr = (const Elf64_Shdr *)(elf + ehdr->e_shoff);
+
+    for (int i = 0; i < ehdr->e_shnum; i++)
+    {
+        if (shdr[i].sh_type != SHT_SYMTAB && shdr[i].sh_type != SHT_DYNSYM)
+            continue;
+        if (shdr[i].sh_size > len || shdr[i].sh_offset > len - shdr[i].sh_size)
+            continue;
+
+        const Elf64_Sym *sym = (const Elf64_Sym *)(elf + shdr[i].sh_offset);
+        for (size_t j = 0; j < shdr[i].sh_size / sizeof(*sym); j++)
+        {
+            int type = ELF64_ST_TYPE(sym[j].st_info);
+            if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+                sym[j].st_shndx == SHN_UNDEF || sym[j].st_value == 0)
+                continue;
+            symtab = symtab || shdr[i].sh_type == SHT_SYMTAB;
+
+            // Symbols are link addresses, find their file offset.
+            for (int k = 0; k < ehdr->e_phnum; k++)
+            {
+                if (phdr[k].p_type != PT_LOAD || sym[j].st_value < phdr[k].p_vaddr ||
+                    sym[j].st_value - phdr[k].p_vaddr >= phdr[k].p_filesz)
+                    continue;
+
+                uint64_t off = sym[j].st_value - phdr[k].p_vaddr + phdr[k].p_offset;
+                if (off >= seg->offset && off - seg->offset < seg->size &&
+                    !push_entry(seg, &capacity, seg->vaddr + off - seg->offset))
+                    goto clean;
+                break;
+            }
+        }
+    }
+
+    if (!symtab)
+    {
+        uint64_t end = seg->offset + seg->size;
+        if (end > len)
+            end = len;
+        for (uint64_t off = seg->offset; off + sizeof(endbr64) <= end; off++)
+            if ((!memcmp(elf + off, endbr64, sizeof(endbr64)) ||
+                 !memcmp(elf + off, push_rbp, sizeof(push_rbp))) &&
+                !push_entry(seg, &capacity, seg->vaddr + off - seg->offset))
+                goto clean;
+    }
+
+    // Aliases share an address.
+    qsort(seg->entries, seg->count, sizeof(*seg->entries), compare_entries);
+    size_t n = 0;
+    for (size_t i = 0; i < seg->count; i++)
+        if (n == 0 || seg->entries[n - 1] != seg->entries[i])
+            seg->entries[n++] = seg->entries[i];
+    seg->count = n;
+    ok = true;
+
+clean:
+    // Nothing half done, the tree needs the entries in order.
+    if (!ok)
+        seg->count = 0;
+    return ok;
+}
+
+/*
+ * Collect the function entries of a segment from its file, see scan_elf().
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool read_segment(struct func_segment *seg)
+{
+    const uint8_t *elf = MAP_FAILED;
+    struct stat st;
+    bool ok;
+
+    int fd = open(seg->file, O_RDONLY);
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+        elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd != -1)
+        close(fd);
+    if (elf == MAP_FAILED)
+    {
+        printf("Error: opening %s\n", seg->file);
+        return false;
+    }
+
+    ok = scan_elf(seg, elf, st.st_size, seg->file);
+    munmap((void *)elf, st.st_size);
+    return ok;
+}
+
+// Lay out `in' as the tree under node `k', in order from `in[i]'.
+static size_t eytzinger(uint64_t *tree, const uint64_t *in, size_t i, size_t k,
+                        size_t n)
+{
+    if (k <= n)
+    {
+        i = eytzinger(tree, in, i, 2 * k, n);
+        tree[k] = in[i++];
+        i = eytzinger(tree, in, i, 2 * k + 1, n);
+    }
+    return i;
+}
+
+/*
+ * Read the new segments and rebuild the tree over all of them.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool func_entries_build(struct func_entries *entries)
+{
+    uint64_t *sorted;
+    size_t n = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < entries->count; i++)
+    {
+        struct func_segment *seg = &entries->segs[i];
+        if (seg->file != NULL)
+        {
+            // Only tried once.
+            ok = read_segment(seg) && ok;
+            free(seg->file);
+            seg->file = NULL;
+        }
+        n += seg->count;
+    }
+    entries->pending = false;
+
+    // The segments are in order, and so are their entries.
+    sorted = malloc(n * sizeof(*sorted));
+    uint64_t *tree = malloc((n + 1) * sizeof(*tree));
+    if ((n && sorted == NULL) || tree == NULL)
+    {
+        printf("Error: allocating function entries");
+        free(sorted);
+        free(tree);
+        return false;
+    }
+    n = 0;
+    for (size_t i = 0; i < entries->count; i++)
+    {
+        memcpy(sorted + n, entries->segs[i].entries,
+               entries->segs[i].count * sizeof(*sorted));
+        n += entries->segs[i].count;
+    }
+    eytzinger(tree, sorted, 0, 1, n);
+    free(sorted);
+
+    free(entries->tree);
+    entries->tree = tree;
+    entries->n = n;
+    return ok;
+}
+
+/*
+ * Returns the first entry at or after `ip', or UINT64_MAX if there is none.
+ */
+static uint64_t func_entries_lower_bound(struct func_entries *entries, uint64_t ip)
+{
+    const uint64_t *tree;
+    size_t k = 1;
+
+    if (entries->pending)
+        func_entries_build(entries);
+    if (entries->tree == NULL)
+        return UINT64_MAX;
+    tree = entries->tree;
+
+    while (k <= entries->n)
+    {
+        // Eight entries to a cache line: three levels down.
+        __builtin_prefetch(tree + k * 8);
+        k = 2 * k + (tree[k] < ip);
+    }
+    // Undo the right turns after the last left one.
+    k >>= __builtin_ffsll(~k);
+    return k ? tree[k] : UINT64_MAX;
+}
+
+/*
+ * Allocate an empty set of function entries.
+ *
+ * Returns the set or NULL on error.
+ */
+struct func_entries *func_entries_alloc(void)
+{
+    struct func_entries *entries = calloc(1, sizeof(*entries));
+    if (entries == NULL)
+        printf("Error: allocating function entries");
+    return entries;
+}
+
+/*
+ * Copy `entries', for the image of a forked process.
+ *
+ * Returns the copy or NULL on error.
+ */
+struct func_entries *func_entries_copy(const struct func_entries *entries)
+{
+    struct func_entries *copy = func_entries_alloc();
+    if (copy == NULL)
+        return NULL;
+
+    copy->segs = malloc(entries->capacity * sizeof(*copy->segs));
+    if (entries->capacity && copy->segs == NULL)
+        goto fail;
+    copy->capacity = entries->capacity;
+    for (size_t i = 0; i < entries->count; i++)
+    {
+        struct func_segment *seg = &copy->segs[copy->count];
+
+        *seg = entries->segs[i];
+        seg->file = NULL;
+        seg->entries = malloc(seg->count * sizeof(*seg->entries));
+        if (entries->segs[i].file != NULL)
+            seg->file = strdup(entries->segs[i].file);
+        copy->count++;
+        if ((seg->count && seg->entries == NULL) ||
+            (entries->segs[i].file != NULL && seg->file == NULL))
+            goto fail;
+        memcpy(seg->entries, entries->segs[i].entries,
+               seg->count * sizeof(*seg->entries));
+    }
+    // Built again on first use.
+    copy->pending = true;
+    return copy;
+
+fail:
+    printf("Error: copying function entries");
+    func_entries_free(copy);
+    return NULL;
+}
+
+/*
+ * Drop the segments overlapping `size' bytes at `vaddr'.
+ *
+ * Returns the index a segment for those bytes goes to.
+ */
+static size_t drop_entries(struct func_entries *entries, uint64_t vaddr, uint64_t size)
+{
+    size_t first, last;
+
+    // Segments [first, last) overlap the range.
+    for (first = 0; first < entries->count; first++)
+        if (entries->segs[first].vaddr + entries->segs[first].size > vaddr)
+            break;
+    for (last = first; last < entries->count; last++)
+    {
+        if (entries->segs[last].vaddr >= vaddr + size)
+            break;
+        free(entries->segs[last].entries);
+        free(entries->segs[last].file);
+    }
+
+    memmove(&entries->segs[first], &entries->segs[last],
+            (entries->count - last) * sizeof(*entries->segs));
+    entries->count -= last - first;
+    entries->pending = true;
+    return first;
+}
+
+/*
+ * Insert an empty segment of `size' bytes at `vaddr', in place of any it
+ * overlaps.
+ *
+ * Returns the segment or NULL on error.
+ */
+static struct func_segment *insert_entries(struct func_entries *entries, uint64_t vaddr,
+                                           uint64_t size)
+{
+    if (entries->count == entries->capacity)
+    {
+        size_t new_capacity = entries->capacity ? entries->capacity * 2 : 32;
+        void *new_segs = realloc(entries->segs, new_capacity * sizeof(*entries->segs));
+        if (new_segs == NULL)
+        {
+            printf("Error: growing function entries");
+            return NULL;
+        }
+        entries->segs = new_segs;
+        entries->capacity = new_capacity;
+    }
+
+    size_t i = drop_entries(entries, vaddr, size);
+    memmove(&entries->segs[i + 1], &entries->segs[i],
+            (entries->count - i) * sizeof(*entries->segs));
+    entries->count++;
+    memset(&entries->segs[i], 0, sizeof(entries->segs[i]));
+    entries->segs[i].vaddr = vaddr;
+    entries->segs[i].size = size;
+    return &entries->segs[i];
+}
+
+/*
+ * Add the function entries of `size' bytes of `file' from `offset', mapped
+ * at `vaddr'. The segment replaces any it overlaps, and its file is only
+ * read once a target is checked.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool func_entries_add_file(struct func_entries *entries, const char *file,
+                           uint64_t offset, uint64_t size, uint64_t vaddr)
+{
+    struct func_segment *seg;
+
+    if (size == 0)
+        return true;
+
+    char *name = strdup(file);
+    if (name == NULL)
+    {
+        printf("Error: growing function entries");
+        return false;
+    }
+    seg = insert_entries(entries, vaddr, size);
+    if (seg == NULL)
+    {
+        free(name);
+        return false;
+    }
+    seg->file = name;
+    seg->offset = offset;
+    return true;
+}
+
+/*
+ * Add the function entries of `elf', an object `name' of `size' bytes that is
+ * in no file, such as the vdso, mapped whole at `vaddr'. It is read right
+ * away.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool func_entries_add_code(struct func_entries *entries, const char *name,
+                           const uint8_t *elf, uint64_t size, uint64_t vaddr)
+{
+    struct func_segment *seg;
+
+    if (size == 0)
+        return true;
+
+    seg = insert_entries(entries, vaddr, size);
+    return seg != NULL && scan_elf(seg, elf, size, name);
+}
+
+/*
+ * Forget the function entries of `size' bytes at `vaddr', which were
+ * unmapped.
+ */
+void func_entries_remove(struct func_entries *entries, uint64_t vaddr, uint64_t size)
+{
+    drop_entries(entries, vaddr, size);
+}
+
+/*
+ * Is `ip' the entry of some function?
+ */
+bool func_entries_contains(struct func_entries *entries, uint64_t ip)
+{
+    return func_entries_lower_bound(entries, ip) == ip;
+}
+
+/*
+ * Are `a' and `b' in the same function, with no entry after the lower one
+ * up to the higher one?
+ */
+bool func_entries_same_function(struct func_entries *entries, uint64_t a, uint64_t b)
+{
+    uint64_t lo = a < b ? a : b, hi = a < b ? b : a;
+    return func_entries_lower_bound(entries, lo + 1) > hi;
+}
+
+/*
+ * Free a set of function entries.
+ */
+void func_entries_free(struct func_entries *entries)
+{
+    if (entries == NULL)
+        return;
+    for (size_t i = 0; i < entries->count; i++)
+    {
+        free(entries->segs[i].entries);
+        free(entries->segs[i].file);
+    }
+    free(entries->segs);
+    free(entries->tree);
+    free(entries);
+}
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#define SYSFS_PT_NUM_RANGES "/sys/bus/event_source/devices/intel_pt/caps/num_address_ranges"
+#define MAX_FILTER_RANGES 16
+#define MAX_FILTER_STR 8192
+
+// Private prototypes.
+static int max_filter_ranges(void);
+
+// Public prototypes.
+bool apply_ip_filter(struct perf_ctx *, const char *exe, const char *objects);
+
+/*
+ * Number of address ranges the PT hardware can filter on.
+ *
+ * Returns the number, or 0 if address filtering is unsupported.
+ */
+static int max_filter_ranges(void)
+{
+    FILE *caps;
+    int n = 0;
+
+    caps = fopen(SYSFS_PT_NUM_RANGES, "r");
+    if (caps == NULL)
+        return 0;
+    if (fscanf(caps, "%d", &n) != 1)
+        n = 0;
+    fclose(caps);
+    return n;
+}
+
+/*
+ * Only trace the code of `objects', a comma separated list of ELF files in
+ * which "exe" stands for the tracee's executable `exe'.
+ *
+ * Every executable load segment becomes one file-relative address range, so
+ * the kernel places the ranges wherever the files end up mapped, including
+ * libraries loaded after the filter is set.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool apply_ip_filter(struct perf_ctx *tr_ctx, const char *exe, const char *objects)
+{
+    struct elf_range ranges[MAX_FILTER_RANGES];
+    char filter[MAX_FILTER_STR];
+    char *copy, *tok, *save;
+    int max, used = 0;
+    size_t len = 0;
+    bool ok = true;
+
+    max = max_filter_ranges();
+    if (max == 0)
+    {
+        printf("Error: PT address filtering unsupported\n");
+        return false;
+    }
+    if (max > MAX_FILTER_RANGES)
+        max = MAX_FILTER_RANGES;
+
+    copy = strdup(objects);
+    if (copy == NULL)
+        return false;
+
+    filter[0] = '\0';
+    for (tok = strtok_r(copy, ",", &save); tok != NULL && ok;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        const char *file = strcmp(tok, "exe") == 0 ? exe : tok;
+
+        int n = load_elf_text(file, ranges + used, max - used, "ip_filter");
+        if (n == -pte_nomem)
+        {
+            printf("Error: more than %d filter ranges\n", max);
+            ok = false;
+            break;
+        }
+        if (n < 0)
+        {
+            ok = false;
+            break;
+        }
+
+        for (int i = used; i < used + n && ok; i++)
+        {
+            int wrote = snprintf(filter + len, sizeof(filter) - len,
+                                 "filter 0x%" PRIx64 "/0x%" PRIx64 "@%s ",
+                                 ranges[i].offset, ranges[i].size, file);
+            if (wrote < 0 || (size_t)wrote >= sizeof(filter) - len)
+            {
+                printf("Error: filter too long\n");
+                ok = false;
+            }
+            else
+                len += wrote;
+        }
+        used += n;
+    }
+    free(copy);
+
+    if (!ok)
+        return false;
+
+    if (ioctl(tr_ctx->perf_fd, PERF_EVENT_IOC_SET_FILTER, filter) == -1)
+    {
+        printf("Error: setting filter '%s': %s\n", filter, strerror(errno));
+        return false;
+    }
+    return true;
+}
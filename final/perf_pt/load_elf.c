@@ -340,3 +340,88 @@ out:
 	fclose(file);
 	return errcode;
 }
+
+/* An executable PT_LOAD segment, as a range of file offsets. */
+struct elf_range {
+	uint64_t offset;
+	uint64_t size;
+	uint64_t vaddr;
+};
+
+/* Collect the executable load segments of the 64-bit ELF file @name into
+ * @ranges, which has room for @max entries.
+ *
+ * Returns the number of segments found or a negative pt_error_code.
+ */
+int load_elf_text(const char *name, struct elf_range *ranges, int max,
+		  const char *prog)
+{
+	Elf64_Ehdr ehdr;
+	Elf64_Half pidx;
+	FILE *file;
+	size_t count;
+	int errcode, nranges;
+
+	if (!name || !ranges)
+		return -pte_invalid;
+
+	file = fopen(name, "rb");
+	if (!file) {
+		fprintf(stderr, "%s: warning: failed to open %s: %s.\n", prog,
+			name, strerror(errno));
+		return -pte_bad_config;
+	}
+
+	count = fread(&ehdr, sizeof(ehdr), 1, file);
+	if (count != 1 || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+	    ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+		fprintf(stderr, "%s: warning: %s: not a 64-bit ELF file.\n",
+			prog, name);
+		errcode = -pte_bad_config;
+		goto out;
+	}
+
+	if (LONG_MAX < ehdr.e_phoff ||
+	    fseek(file, (long) ehdr.e_phoff, SEEK_SET)) {
+		fprintf(stderr,
+			"%s: warning: %s error seeking program header.\n",
+			prog, name);
+		errcode = -pte_bad_config;
+		goto out;
+	}
+
+	for (nranges = 0, pidx = 0; pidx < ehdr.e_phnum; ++pidx) {
+		Elf64_Phdr phdr;
+
+		count = fread(&phdr, sizeof(phdr), 1, file);
+		if (count != 1) {
+			fprintf(stderr,
+				"%s: warning: %s error reading phdr %u: %s.\n",
+				prog, name, pidx, strerror(errno));
+			errcode = -pte_bad_config;
+			goto out;
+		}
+
+		if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X))
+			continue;
+
+		if (!phdr.p_filesz)
+			continue;
+
+		if (nranges == max) {
+			errcode = -pte_nomem;
+			goto out;
+		}
+
+		ranges[nranges].offset = phdr.p_offset;
+		ranges[nranges].size = phdr.p_filesz;
+		ranges[nranges].vaddr = phdr.p_vaddr;
+		nranges += 1;
+	}
+
+	errcode = nranges;
+
+out:
+	fclose(file);
+	return errcode;
+}
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+
+/*
+ * A window of trace waiting to be decoded.
+ */
+struct trace_job
+{
+    void *buf;                        // Private copy of the window.
+    size_t len;                       // Length of `buf'.
+    struct inst_decoder_ctx *decoder; // Decoder of the traced thread.
+    pid_t pid;                        // Process the thread belongs to.
+    struct perf_mmap *mmaps;          // Mappings made up to this window.
+    bool lost;                        // Did the AUX buffer overflow in it?
+    struct trace_job *next;           // Next window, in trace order.
+};
+
+/*
+ * Decodes trace windows on a worker thread so that the tracee only waits for
+ * the verdict at barrier syscalls.
+ */
+struct decode_pipeline
+{
+    pthread_t worker;                 // Decoder thread handle.
+    pthread_mutex_t lock;             // Guards everything below.
+    pthread_cond_t cond;              // Signalled on new work and on idle.
+    struct trace_job *head, *tail;    // Queue of pending windows.
+    bool busy;                        // Is the worker decoding a window?
+    bool stopping;                    // Tell the worker to exit when idle.
+    pid_t *killed;                    // Processes killed for an attack,
+    int nkilled;                      // their windows are skipped.
+    struct stats_config *stats;
+} pipeline;
+
+// Private prototypes.
+static bool decode_job(struct decode_pipeline *, struct trace_job *);
+static bool pipeline_killed(struct decode_pipeline *, pid_t);
+static void *pipeline_worker(void *);
+
+// Public prototypes.
+bool pipeline_start(struct decode_pipeline *, struct stats_config *);
+bool pipeline_submit(struct decode_pipeline *, struct perf_ctx *,
+                     struct inst_decoder_ctx *, pid_t);
+bool pipeline_wait(struct decode_pipeline *, pid_t);
+void pipeline_stop(struct decode_pipeline *);
+
+/*
+ * Decode one window, prefixed by whatever the thread's previous window left
+ * after its last PSB.
+ *
+ * Returns false if an attack was detected, true otherwise.
+ */
+static bool decode_job(struct decode_pipeline *pl, struct trace_job *job)
+{
+    struct inst_decoder_ctx *dec = job->decoder;
+    size_t len = dec->carry_len + job->len;
+    bool safe;
+
+    apply_mmaps(dec, job->mmaps);
+
+    if (len > dec->carry_capacity)
+    {
+        void *new_buf = realloc(dec->carry, len * 2);
+        if (new_buf == NULL)
+        {
+            printf("Error: growing pipeline buffer");
+            return true;
+        }
+        dec->carry = new_buf;
+        dec->carry_capacity = len * 2;
+    }
+    memcpy(dec->carry + dec->carry_len, job->buf, job->len);
+
+    if (!set_decoder_window(dec, dec->carry, len))
+        printf("error: decoder window\n");
+
+    dec->window_lost = job->lost;
+    safe = decode_trace(dec, pl->stats);
+
+    // Keep the trace from the last PSB on for the next window, unless the
+    // trace stopped short of its end.
+    size_t consumed = safe && !job->lost ? dec->sync_offset : len;
+    memmove(dec->carry, dec->carry + consumed, len - consumed);
+    dec->carry_len = len - consumed;
+    if (job->lost)
+        forget_flow(dec);
+    else if (!safe)
+        dec->seen = 0;
+    return safe;
+}
+
+/*
+ * Was process `pid' killed for an attack? Any process if `pid' is 0.
+ *
+ * Must be called with the pipeline lock held.
+ */
+static bool pipeline_killed(struct decode_pipeline *pl, pid_t pid)
+{
+    if (pid == 0)
+        return pl->nkilled > 0;
+    for (int i = 0; i < pl->nkilled; i++)
+        if (pl->killed[i] == pid)
+            return true;
+    return false;
+}
+
+/*
+ * Body of the decoder thread: decode queued windows in order.
+ */
+static void *pipeline_worker(void *arg)
+{
+    struct decode_pipeline *pl = arg;
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;)
+    {
+        while (pl->head == NULL && !pl->stopping)
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        if (pl->head == NULL)
+            break;
+
+        struct trace_job *job = pl->head;
+        pl->head = job->next;
+        if (pl->head == NULL)
+            pl->tail = NULL;
+        pl->busy = true;
+        bool skip = pipeline_killed(pl, job->pid);
+        pthread_mutex_unlock(&pl->lock);
+
+        // Once the process is being killed there is nothing left to decide
+        // about it. Other processes are still checked.
+        bool safe = skip || decode_job(pl, job);
+        pid_t pid = job->pid;
+        perf_free_mmaps(job->mmaps);
+        free(job->buf);
+        free(job);
+
+        pthread_mutex_lock(&pl->lock);
+        pl->busy = false;
+        if (!safe && !pipeline_killed(pl, pid))
+        {
+            pid_t *killed = realloc(pl->killed, (pl->nkilled + 1) * sizeof(*killed));
+            if (killed == NULL)
+                printf("Error: recording killed process %d\n", pid);
+            else
+            {
+                pl->killed = killed;
+                pl->killed[pl->nkilled++] = pid;
+            }
+            // Don't wait for the next barrier.
+            kill(pid, SIGKILL);
+        }
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+/*
+ * Start the decoder thread. Decoders of submitted windows are owned by the
+ * thread until pipeline_wait() returns.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool pipeline_start(struct decode_pipeline *pl, struct stats_config *stats)
+{
+    memset(pl, 0, sizeof(*pl));
+    pl->stats = stats;
+
+    if (pthread_mutex_init(&pl->lock, NULL) != 0 ||
+        pthread_cond_init(&pl->cond, NULL) != 0)
+    {
+        printf("Error: creating pipeline lock");
+        return false;
+    }
+
+    if (pthread_create(&pl->worker, NULL, pipeline_worker, pl) != 0)
+    {
+        printf("Error: spawning decoder thread");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Copy the trace `tracer' collected since the last stop into the queue and
+ * hand the whole window back to the collector, so the tracee can be resumed
+ * straight away. `pid' is the thread's process, killed if the window shows
+ * an attack.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool pipeline_submit(struct decode_pipeline *pl, struct perf_ctx *tracer,
+                     struct inst_decoder_ctx *decoder, pid_t pid)
+{
+    void *window;
+    size_t window_len;
+
+    if (!perf_next_window(tracer, &window, &window_len))
+    {
+        printf("Error: reading AUX buffer\n");
+        return false;
+    }
+
+    if (window_len == 0)
+    {
+        perf_release_window(tracer, 0);
+        return true;
+    }
+
+    struct trace_job *job = malloc(sizeof(*job));
+    if (job != NULL)
+        job->buf = malloc(window_len);
+    if (job == NULL || job->buf == NULL)
+    {
+        printf("Error: allocating trace job");
+        free(job);
+        perf_release_window(tracer, 0);
+        return false;
+    }
+    memcpy(job->buf, window, window_len);
+    job->len = window_len;
+    job->decoder = decoder;
+    job->pid = pid;
+    job->mmaps = tracer->window_mmaps;
+    job->lost = tracer->window_lost;
+    tracer->window_mmaps = NULL;
+    job->next = NULL;
+    perf_release_window(tracer, window_len);
+
+    // A resize dropped trace that followed the window, so nothing carries
+    // on from it.
+    job->lost |= tracer->tail_dropped;
+    tracer->tail_dropped = false;
+
+    pthread_mutex_lock(&pl->lock);
+    if (pl->tail != NULL)
+        pl->tail->next = job;
+    else
+        pl->head = job;
+    pl->tail = job;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+    return true;
+}
+
+/*
+ * Barrier: wait until every submitted window has been analysed, or until
+ * process `pid' is killed. With `pid' 0, wait for every window.
+ *
+ * Returns false if an attack was detected in process `pid' (in any process
+ * if 0), true otherwise.
+ */
+bool pipeline_wait(struct decode_pipeline *pl, pid_t pid)
+{
+    bool safe;
+
+    pthread_mutex_lock(&pl->lock);
+    while ((pl->head != NULL || pl->busy) &&
+           (pid == 0 || !pipeline_killed(pl, pid)))
+        pthread_cond_wait(&pl->cond, &pl->lock);
+    safe = !pipeline_killed(pl, pid);
+    pthread_mutex_unlock(&pl->lock);
+    return safe;
+}
+
+/*
+ * Finish the queued windows and stop the decoder thread.
+ */
+void pipeline_stop(struct decode_pipeline *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->stopping = true;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    pthread_join(pl->worker, NULL);
+
+    while (pl->head != NULL)
+    {
+        struct trace_job *job = pl->head;
+        pl->head = job->next;
+        perf_free_mmaps(job->mmaps);
+        free(job->buf);
+        free(job);
+    }
+    free(pl->killed);
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->lock);
+}
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <intel-pt.h>
+#include <linux/perf_event.h>
+
+#define SYSFS_PT_DIR "/sys/bus/event_source/devices/intel_pt"
+
+/*
+ * Intel PT packet generation controls. Each knob is a field of the perf
+ * attr.config as described by the PMU's format/ directory in sysfs, and is
+ * checked against the caps/ directory before use.
+ */
+struct pt_knobs
+{
+    int branch;     // Branch (COFI) packets, needed by the analysis.
+    int noretcomp;  // Disable return compression.
+    int tsc;        // TSC timestamp packets.
+    int mtc;        // MTC timing packets.
+    int mtc_period; // MTC every 2^mtc_period ART ticks.
+    int cyc;        // Cycle count packets.
+    int cyc_thresh; // Cycle count threshold.
+    int pwr_evt;    // Power event packets.
+    int psb_period; // PSB every 2^(psb_period + 11) bytes, -1 for the largest.
+};
+
+struct pt_knob_name
+{
+    const char *name; // File in format/ and option name.
+    size_t offset;    // Field in struct pt_knobs.
+    const char *cap;  // Bitmask of supported values in caps/, or NULL.
+};
+
+static const struct pt_knob_name pt_knob_names[] = {
+    {"branch", offsetof(struct pt_knobs, branch), NULL},
+    {"noretcomp", offsetof(struct pt_knobs, noretcomp), NULL},
+    {"tsc", offsetof(struct pt_knobs, tsc), NULL},
+    {"mtc", offsetof(struct pt_knobs, mtc), NULL},
+    {"mtc_period", offsetof(struct pt_knobs, mtc_period), "mtc_periods"},
+    {"cyc", offsetof(struct pt_knobs, cyc), NULL},
+    {"cyc_thresh", offsetof(struct pt_knobs, cyc_thresh), "cycle_thresholds"},
+    {"pwr_evt", offsetof(struct pt_knobs, pwr_evt), NULL},
+    {"psb_period", offsetof(struct pt_knobs, psb_period), "psb_periods"},
+    {NULL, 0, NULL}};
+
+// Branches only, with the fewest PSBs: the smallest trace that still gives
+// the control flow.
+static const struct pt_knobs pt_profile_rop = {
+    .branch = 1,
+    .psb_period = -1};
+
+// The configuration used before the knobs existed (attr.config 0x300e601).
+static const struct pt_knobs pt_profile_legacy = {
+    .branch = 1,
+    .tsc = 1,
+    .mtc = 1,
+    .mtc_period = 3,
+    .psb_period = 3};
+
+// Public prototypes.
+bool parse_pt_knobs(const char *list, struct pt_knobs *knobs);
+bool pt_knobs_attr_config(struct pt_knobs *knobs, __u64 *config);
+void pt_knobs_decoder_config(const struct pt_knobs *knobs, struct pt_config *config);
+
+// Private prototypes.
+static bool read_pt_sysfs(const char *, const char *, char *, size_t);
+static long pt_cap(const char *);
+static bool pt_format_field(const char *, int *, int *);
+
+/*
+ * Read the first line of file `name' in directory `dir' of the PMU.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool read_pt_sysfs(const char *dir, const char *name, char *buf, size_t len)
+{
+    char path[256];
+    FILE *file;
+    bool ok;
+
+    snprintf(path, sizeof(path), SYSFS_PT_DIR "/%s%s", dir, name);
+    file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+    ok = fgets(buf, len, file) != NULL;
+    fclose(file);
+    return ok;
+}
+
+/*
+ * Read capability `name', which the kernel prints in hex.
+ *
+ * Returns its value, or 0 if the capability is unknown.
+ */
+static long pt_cap(const char *name)
+{
+    char buf[64];
+
+    if (!read_pt_sysfs("caps/", name, buf, sizeof(buf)))
+        return 0;
+    return strtol(buf, NULL, 16);
+}
+
+/*
+ * Look up the bits of attr.config holding knob `name', e.g. "config:14-17".
+ *
+ * Returns true on success or false if the kernel doesn't know the knob.
+ */
+static bool pt_format_field(const char *name, int *lo, int *hi)
+{
+    char buf[64];
+
+    if (!read_pt_sysfs("format/", name, buf, sizeof(buf)))
+        return false;
+
+    switch (sscanf(buf, "config:%d-%d", lo, hi))
+    {
+    case 1:
+        *hi = *lo;
+        return true;
+    case 2:
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Parse a comma separated list of profiles ("rop", "legacy") and knob=value
+ * pairs into `knobs', later entries overriding earlier ones. A NULL `list'
+ * selects the rop profile.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool parse_pt_knobs(const char *list, struct pt_knobs *knobs)
+{
+    char *copy, *tok, *save, *value, *rest;
+
+    *knobs = pt_profile_rop;
+    if (list == NULL)
+        return true;
+
+    copy = strdup(list);
+    if (copy == NULL)
+        return false;
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        const struct pt_knob_name *kn;
+
+        if (strcmp(tok, "rop") == 0)
+        {
+            *knobs = pt_profile_rop;
+            continue;
+        }
+        if (strcmp(tok, "legacy") == 0)
+        {
+            *knobs = pt_profile_legacy;
+            continue;
+        }
+
+        value = strchr(tok, '=');
+        if (value != NULL)
+            *value++ = '\0';
+
+        for (kn = pt_knob_names; kn->name; kn++)
+            if (strcmp(kn->name, tok) == 0)
+                break;
+
+        errno = 0;
+        long v = value != NULL ? strtol(value, &rest, 0) : 0;
+        if (kn->name == NULL || value == NULL || errno || *rest || v < 0)
+        {
+            fprintf(stderr, "bad PT knob: %s\n", tok);
+            free(copy);
+            return false;
+        }
+        *(int *)((char *)knobs + kn->offset) = v;
+    }
+
+    free(copy);
+    return true;
+}
+
+/*
+ * Turn `knobs' into a perf attr.config for the intel_pt PMU, checking every
+ * value against what the hardware supports. A psb_period of -1 is resolved
+ * to the largest supported period.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool pt_knobs_attr_config(struct pt_knobs *knobs, __u64 *config)
+{
+    int lo, hi;
+
+    if (knobs->psb_period == -1)
+    {
+        long periods = pt_cap("psb_periods");
+        knobs->psb_period = 0;
+        for (int i = 0; i < 16; i++)
+            if (periods & (1l << i))
+                knobs->psb_period = i;
+    }
+
+    if ((knobs->mtc && !pt_cap("mtc")) || (knobs->cyc && !pt_cap("psb_cyc")) ||
+        (knobs->pwr_evt && !pt_cap("power_event_trace")))
+    {
+        printf("Error: PT packets not supported by this CPU\n");
+        return false;
+    }
+    if (!knobs->branch)
+        printf("warning: branch tracing disabled, nothing to analyse\n");
+
+    // Setting "pt" makes the kernel honour "branch" instead of forcing it on.
+    *config = 0;
+    if (pt_format_field("pt", &lo, &hi))
+        *config |= 1ull << lo;
+
+    for (const struct pt_knob_name *kn = pt_knob_names; kn->name; kn++)
+    {
+        int v = *(const int *)((const char *)knobs + kn->offset);
+
+        if (v == 0)
+            continue;
+
+        if (!pt_format_field(kn->name, &lo, &hi) || v >= (1 << (hi - lo + 1)))
+        {
+            printf("Error: PT knob %s=%d not supported\n", kn->name, v);
+            return false;
+        }
+
+        // Multi-value knobs list the supported values as a bitmask.
+        if (kn->cap != NULL && !(pt_cap(kn->cap) & (1l << v)))
+        {
+            printf("Error: PT knob %s=%d not supported by this CPU\n", kn->name, v);
+            return false;
+        }
+
+        *config |= (__u64)v << lo;
+    }
+    return true;
+}
+
+/*
+ * Fill in the parts of a libipt decoder `config' that depend on the packets
+ * the hardware was asked to generate.
+ */
+void pt_knobs_decoder_config(const struct pt_knobs *knobs, struct pt_config *config)
+{
+    char buf[64];
+    unsigned int eax, ebx, ratio;
+
+    // MTC and CYC packets can only be turned into time with these.
+    if (knobs->mtc)
+        config->mtc_freq = knobs->mtc_period;
+
+    if ((knobs->mtc || knobs->cyc) &&
+        read_pt_sysfs("", "tsc_art_ratio", buf, sizeof(buf)) &&
+        sscanf(buf, "%u:%u", &eax, &ebx) == 2)
+    {
+        config->cpuid_0x15_eax = eax;
+        config->cpuid_0x15_ebx = ebx;
+    }
+
+    if (knobs->cyc && read_pt_sysfs("", "max_nonturbo_ratio", buf, sizeof(buf)) &&
+        sscanf(buf, "%u", &ratio) == 1)
+        config->nom_freq = ratio;
+}
@@ -35,7 +35,10 @@ static void xed_print_insn(const xed_decoded_inst_t *inst, uint64_t ip);
 static xed_machine_mode_enum_t translate_mode(enum pt_exec_mode mode);
 static void print_raw_insn(const struct pt_insn *insn);
 static void print_raw_insn_file(const struct pt_insn *insn);
-static int drain_events_insn(struct pt_insn_decoder *decoder, int status);
+static int drain_events_insn(struct pt_insn_decoder *decoder, int status,
+			     int *overflows);
+static int drain_events_blk(struct pt_block_decoder *decoder, int status,
+			    int *overflows);
 
 static const char *print_exec_mode(enum pt_exec_mode mode)
 {
@@ -99,17 +102,44 @@ static void print_raw_insn_file(const struct pt_insn *insn)
 	fprintf(bufferFd, "\n");
 }
 
-static int drain_events_insn(struct pt_insn_decoder *decoder, int status)
+/*
+Consume pending events, counting the overflows: the trace between an
+overflow and the IP the decoder resumed at was lost.
+*/
+static int drain_events_insn(struct pt_insn_decoder *decoder, int status,
+			     int *overflows)
 {
-	int errcode;
 	while (status & pts_event_pending)
 	{
 		struct pt_event event;
-		uint64_t offset;
 
 		status = pt_insn_event(decoder, &event, sizeof(event));
 		if (status < 0)
 			return status;
+
+		if (event.type == ptev_overflow)
+			(*overflows)++;
+	}
+
+	return status;
+}
+
+/*
+Same as drain_events_insn(), for the block decoder.
+*/
+static int drain_events_blk(struct pt_block_decoder *decoder, int status,
+			    int *overflows)
+{
+	while (status & pts_event_pending)
+	{
+		struct pt_event event;
+
+		status = pt_blk_event(decoder, &event, sizeof(event));
+		if (status < 0)
+			return status;
+
+		if (event.type == ptev_overflow)
+			(*overflows)++;
 	}
 
 	return status;
@@ -0,0 +1,568 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <xed/xed-interface.h>
+
+// Bitmaps are kept here, for every tracee and run to share.
+#define RET_SITES_CACHE "/tmp/ipt-callsites"
+// Segments disassembled at once.
+#define RET_SITES_THREADS 16
+
+/*
+ * The return sites of one executable segment of a file: bit `i' is set if
+ * the byte at offset `i' of the segment follows a near call. Offsets don't
+ * depend on where the segment is mapped, so every process mapping it shares
+ * one bitmap, mapped from the cache.
+ */
+struct site_bitmap
+{
+    uint64_t *bits; // `len' bytes, mapped.
+    size_t len;
+    int refs;       // Segments using it.
+};
+
+/*
+ * A segment of the image and its return sites, built on first use.
+ */
+struct site_segment
+{
+    uint64_t vaddr;          // Where the segment is mapped.
+    uint64_t size;
+    char *file;              // Where its code comes from, or NULL if it
+                             // was given in memory.
+    uint64_t offset;
+    struct site_bitmap *map; // NULL until built, or if that failed.
+};
+
+/*
+ * The return sites of an image: the address right after every near call in
+ * its code. A return that lands anywhere else was not set up by a call.
+ */
+struct ret_sites
+{
+    struct site_segment *segs; // Sorted by `vaddr', without overlaps.
+    size_t count;
+    size_t capacity;
+    bool pending;              // Are some segments not built yet?
+};
+
+// Private prototypes.
+static bool cache_usable(void);
+static void mark_sites(uint64_t *, const uint8_t *, size_t, const uint64_t *, size_t);
+static struct site_bitmap *map_bitmap(int, size_t, bool);
+static void unref_bitmap(struct site_bitmap *);
+static void *build_segment(void *);
+static bool ret_sites_build(struct ret_sites *);
+static bool grow_sites(struct ret_sites *);
+static size_t drop_sites(struct ret_sites *, uint64_t, uint64_t);
+
+// Public prototypes.
+struct ret_sites *ret_sites_alloc(void);
+struct ret_sites *ret_sites_copy(const struct ret_sites *);
+bool ret_sites_add_file(struct ret_sites *, const char *file, uint64_t offset,
+                        uint64_t size, uint64_t vaddr);
+bool ret_sites_add_code(struct ret_sites *, const uint8_t *code, uint64_t size,
+                        uint64_t vaddr);
+void ret_sites_remove(struct ret_sites *, uint64_t vaddr, uint64_t size);
+bool ret_sites_contains(struct ret_sites *, uint64_t ip);
+size_t ret_sites_count(struct ret_sites *);
+void ret_sites_free(struct ret_sites *);
+
+/*
+ * Is the cache directory there and ours alone? Anyone who can write to it
+ * could hide return sites from us.
+ */
+static bool cache_usable(void)
+{
+    static int usable = -1;
+    struct stat st;
+
+    if (usable == -1)
+    {
+        mkdir(RET_SITES_CACHE, 0700);
+        usable = lstat(RET_SITES_CACHE, &st) == 0 && S_ISDIR(st.st_mode) &&
+                 st.st_uid == geteuid() && (st.st_mode & 022) == 0;
+        if (!usable)
+            printf("warning: %s unusable, return sites not shared\n", RET_SITES_CACHE);
+    }
+    return usable;
+}
+
+/*
+ * Set the bit of every return site in `len' bytes of 64-bit code, given the
+ * offsets of the `nentries' functions known to start in it.
+ *
+ * The code is disassembled linearly, skipping a byte at a time over anything
+ * XED can't decode. Data in the middle of code can put the sweep out of step
+ * with the instructions that follow, so it starts again from every function
+ * entry, up to an instruction it decoded already. A call after data that no
+ * entry leads to may still be missed, and data may yield spurious sites.
+ */
+static void mark_sites(uint64_t *bits, const uint8_t *code, size_t len,
+                       const uint64_t *entries, size_t nentries)
+{
+    xed_state_t xed;
+    xed_decoded_inst_t inst;
+
+    xed_state_init2(&xed, XED_MACHINE_MODE_LONG_64, XED_ADDRESS_WIDTH_64b);
+
+    // Where decoded instructions start. Without it, only the first sweep.
+    uint64_t *starts = calloc(len / 64 + 1, sizeof(*starts));
+    if (starts == NULL)
+        nentries = 0;
+
+    for (size_t i = 0; i <= nentries; i++)
+    {
+        size_t off = i == 0 ? 0 : entries[i - 1];
+
+        while (off < len && (starts == NULL || !(starts[off >> 6] >> (off & 63) & 1)))
+        {
+            size_t left = len - off;
+
+            if (starts != NULL)
+                starts[off >> 6] |= 1ull << (off & 63);
+
+            xed_decoded_inst_zero_set_mode(&inst, &xed);
+            if (xed_decode(&inst, code + off, left < 15 ? left : 15) != XED_ERROR_NONE)
+            {
+                off++;
+                continue;
+            }
+
+            off += xed_decoded_inst_get_length(&inst);
+            if (xed_decoded_inst_get_iclass(&inst) == XED_ICLASS_CALL_NEAR)
+                bits[off >> 6] |= 1ull << (off & 63);
+        }
+    }
+    free(starts);
+}
+
+/*
+ * Map `len' bytes of bitmap from `fd', or anonymous memory if it is -1.
+ *
+ * Returns the bitmap or NULL on error.
+ */
+static struct site_bitmap *map_bitmap(int fd, size_t len, bool writable)
+{
+    struct site_bitmap *map = malloc(sizeof(*map));
+    if (map == NULL)
+        return NULL;
+
+    map->bits = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+    if (map->bits == MAP_FAILED)
+    {
+        free(map);
+        return NULL;
+    }
+    map->len = len;
+    map->refs = 1;
+    return map;
+}
+
+static void unref_bitmap(struct site_bitmap *map)
+{
+    if (map == NULL || --map->refs > 0)
+        return;
+    munmap(map->bits, map->len);
+    free(map);
+}
+
+/*
+ * Body of a build thread: map the bitmap of a segment from the cache, or
+ * disassemble the segment into a new one, from the function entries its
+ * symbols give, see scan_elf().
+ */
+static void *build_segment(void *arg)
+{
+    struct site_segment *seg = arg;
+    struct func_segment syms = {0};
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct stat st;
+    const uint8_t *elf = MAP_FAILED;
+    uint64_t file_size = 0;
+    int out = -1;
+
+    // One more bit for a call that ends the segment.
+    size_t len = (seg->size / 64 + 1) * sizeof(uint64_t);
+
+    int fd = open(seg->file, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        printf("Error: opening %s\n", seg->file);
+        goto clean;
+    }
+    file_size = st.st_size;
+
+    // A rebuilt or replaced file gets a new bitmap.
+    snprintf(path, sizeof(path),
+             "%s/%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64 ".%09ld-%" PRIx64
+             "-%" PRIx64,
+             RET_SITES_CACHE, (uint64_t)st.st_dev, (uint64_t)st.st_ino, file_size,
+             (uint64_t)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, seg->offset,
+             seg->size);
+    if (cache_usable())
+    {
+        int in = open(path, O_RDONLY | O_NOFOLLOW);
+        if (in != -1 && fstat(in, &st) == 0 && (size_t)st.st_size == len)
+            seg->map = map_bitmap(in, len, false);
+        if (in != -1)
+            close(in);
+        if (seg->map != NULL)
+            goto clean;
+
+        // Built aside and renamed, so no one maps half a bitmap.
+        snprintf(tmp, sizeof(tmp), "%s/build-XXXXXX", RET_SITES_CACHE);
+        out = mkstemp(tmp);
+        if (out != -1 && ftruncate(out, len) == -1)
+        {
+            close(out);
+            unlink(tmp);
+            out = -1;
+        }
+    }
+
+    if (file_size > 0)
+        elf = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    seg->map = elf != MAP_FAILED ? map_bitmap(out, len, true) : NULL;
+    if (seg->map == NULL)
+    {
+        printf("Error: allocating return sites of %s\n", seg->file);
+        if (out != -1)
+            unlink(tmp);
+        goto clean;
+    }
+
+    // The last page of a mapping may extend past the end of the file.
+    if (seg->offset < file_size)
+    {
+        uint64_t n = file_size - seg->offset < seg->size ? file_size - seg->offset
+                                                         : seg->size;
+
+        // Offsets within the segment. Without symbols, the sweep from its
+        // start still runs.
+        syms.offset = seg->offset;
+        syms.size = seg->size;
+        scan_elf(&syms, elf, file_size, seg->file);
+        mark_sites(seg->map->bits, elf + seg->offset, n, syms.entries, syms.count);
+    }
+    if (out != -1 && rename(tmp, path) == -1)
+        unlink(tmp);
+
+clean:
+    if (out != -1)
+        close(out);
+    if (fd != -1)
+        close(fd);
+    if (elf != MAP_FAILED)
+        munmap((void *)elf, file_size);
+    free(syms.entries);
+    return NULL;
+}
+
+/*
+ * Build the bitmaps of all new segments, a thread per segment.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool ret_sites_build(struct ret_sites *sites)
+{
+    pthread_t threads[RET_SITES_THREADS];
+    bool ok = true;
+    size_t i = 0;
+
+    // Neither is safe to do first from several threads.
+    xed_tables_init();
+    cache_usable();
+
+    while (i < sites->count)
+    {
+        struct site_segment *batch[RET_SITES_THREADS];
+        int nbatch = 0, nthreads = 0;
+
+        for (; i < sites->count && nbatch < RET_SITES_THREADS; i++)
+            if (sites->segs[i].map == NULL && sites->segs[i].file != NULL)
+                batch[nbatch++] = &sites->segs[i];
+
+        for (; nthreads < nbatch; nthreads++)
+            if (pthread_create(&threads[nthreads], NULL, build_segment,
+                               batch[nthreads]) != 0)
+                break;
+        // Build whatever didn't get a thread here.
+        for (int j = nthreads; j < nbatch; j++)
+            build_segment(batch[j]);
+        for (int j = 0; j < nthreads; j++)
+            pthread_join(threads[j], NULL);
+
+        for (int j = 0; j < nbatch; j++)
+        {
+            // Only tried once.
+            ok = ok && batch[j]->map != NULL;
+            free(batch[j]->file);
+            batch[j]->file = NULL;
+        }
+    }
+    sites->pending = false;
+    return ok;
+}
+
+/*
+ * Allocate an empty set of return sites.
+ *
+ * Returns the set or NULL on error.
+ */
+struct ret_sites *ret_sites_alloc(void)
+{
+    struct ret_sites *sites = calloc(1, sizeof(*sites));
+    if (sites == NULL)
+        printf("Error: allocating return sites");
+    return sites;
+}
+
+/*
+ * Copy `sites', for the image of a forked process. Bitmaps are shared.
+ *
+ * Returns the copy or NULL on error.
+ */
+struct ret_sites *ret_sites_copy(const struct ret_sites *sites)
+{
+    struct ret_sites *copy = ret_sites_alloc();
+    if (copy == NULL)
+        return NULL;
+
+    copy->segs = malloc(sites->capacity * sizeof(*copy->segs));
+    if (sites->capacity && copy->segs == NULL)
+    {
+        printf("Error: copying return sites");
+        free(copy);
+        return NULL;
+    }
+    copy->capacity = sites->capacity;
+    copy->pending = sites->pending;
+    for (size_t i = 0; i < sites->count; i++)
+    {
+        struct site_segment *seg = &copy->segs[copy->count];
+
+        *seg = sites->segs[i];
+        if (seg->file != NULL && (seg->file = strdup(seg->file)) == NULL)
+        {
+            printf("Error: copying return sites");
+            ret_sites_free(copy);
+            return NULL;
+        }
+        if (seg->map != NULL)
+            seg->map->refs++;
+        copy->count++;
+    }
+    return copy;
+}
+
+/*
+ * Make room for one more segment.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool grow_sites(struct ret_sites *sites)
+{
+    if (sites->count < sites->capacity)
+        return true;
+
+    size_t new_capacity = sites->capacity ? sites->capacity * 2 : 32;
+    void *new_segs = realloc(sites->segs, new_capacity * sizeof(*sites->segs));
+    if (new_segs == NULL)
+    {
+        printf("Error: growing return sites");
+        return false;
+    }
+    sites->segs = new_segs;
+    sites->capacity = new_capacity;
+    return true;
+}
+
+/*
+ * Drop the segments overlapping `size' bytes at `vaddr'.
+ *
+ * Returns the index a segment for those bytes goes to.
+ */
+static size_t drop_sites(struct ret_sites *sites, uint64_t vaddr, uint64_t size)
+{
+    size_t first, last;
+
+    // Segments [first, last) overlap the range.
+    for (first = 0; first < sites->count; first++)
+        if (sites->segs[first].vaddr + sites->segs[first].size > vaddr)
+            break;
+    for (last = first; last < sites->count; last++)
+    {
+        if (sites->segs[last].vaddr >= vaddr + size)
+            break;
+        unref_bitmap(sites->segs[last].map);
+        free(sites->segs[last].file);
+    }
+
+    memmove(&sites->segs[first], &sites->segs[last],
+            (sites->count - last) * sizeof(*sites->segs));
+    sites->count -= last - first;
+    return first;
+}
+
+/*
+ * Add the return sites of `size' bytes of `file' from `offset', mapped at
+ * `vaddr'. The segment replaces any it overlaps, and its code is only
+ * disassembled once a return is checked.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool ret_sites_add_file(struct ret_sites *sites, const char *file, uint64_t offset,
+                        uint64_t size, uint64_t vaddr)
+{
+    if (size == 0)
+        return true;
+
+    if (!grow_sites(sites))
+        return false;
+    char *name = strdup(file);
+    if (name == NULL)
+    {
+        printf("Error: growing return sites");
+        return false;
+    }
+
+    size_t i = drop_sites(sites, vaddr, size);
+    memmove(&sites->segs[i + 1], &sites->segs[i],
+            (sites->count - i) * sizeof(*sites->segs));
+    sites->count++;
+    sites->segs[i].vaddr = vaddr;
+    sites->segs[i].size = size;
+    sites->segs[i].file = name;
+    sites->segs[i].offset = offset;
+    sites->segs[i].map = NULL;
+    sites->pending = true;
+    return true;
+}
+
+/*
+ * Add the return sites of the `size' bytes of ELF image `code', mapped at
+ * `vaddr', for code that is in no file such as the vdso. The segment replaces
+ * any it overlaps and is disassembled right away, without going through the
+ * cache.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool ret_sites_add_code(struct ret_sites *sites, const uint8_t *code, uint64_t size,
+                        uint64_t vaddr)
+{
+    struct func_segment syms = {0};
+    struct site_bitmap *map;
+
+    if (size == 0)
+        return true;
+
+    if (!grow_sites(sites))
+        return false;
+    map = map_bitmap(-1, (size / 64 + 1) * sizeof(uint64_t), true);
+    if (map == NULL)
+    {
+        printf("Error: allocating return sites");
+        return false;
+    }
+    syms.size = size;
+    scan_elf(&syms, code, size, "[vdso]");
+    mark_sites(map->bits, code, size, syms.entries, syms.count);
+    free(syms.entries);
+
+    size_t i = drop_sites(sites, vaddr, size);
+    memmove(&sites->segs[i + 1], &sites->segs[i],
+            (sites->count - i) * sizeof(*sites->segs));
+    sites->count++;
+    sites->segs[i].vaddr = vaddr;
+    sites->segs[i].size = size;
+    sites->segs[i].file = NULL;
+    sites->segs[i].offset = 0;
+    sites->segs[i].map = map;
+    return true;
+}
+
+/*
+ * Forget the return sites of `size' bytes at `vaddr', which were unmapped.
+ */
+void ret_sites_remove(struct ret_sites *sites, uint64_t vaddr, uint64_t size)
+{
+    drop_sites(sites, vaddr, size);
+}
+
+/*
+ * Is `ip' the return site of some call?
+ */
+bool ret_sites_contains(struct ret_sites *sites, uint64_t ip)
+{
+    size_t lo = 0, hi = sites->count;
+
+    if (sites->pending)
+        ret_sites_build(sites);
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        struct site_segment *seg = &sites->segs[mid];
+
+        if (ip < seg->vaddr)
+            hi = mid;
+        else if (ip - seg->vaddr >= seg->size)
+            lo = mid + 1;
+        else if (seg->map == NULL)
+            return false;
+        else
+        {
+            uint64_t off = ip - seg->vaddr;
+            return seg->map->bits[off >> 6] >> (off & 63) & 1;
+        }
+    }
+    return false;
+}
+
+/*
+ * Count the return sites, building any bitmaps not built yet.
+ */
+size_t ret_sites_count(struct ret_sites *sites)
+{
+    size_t count = 0;
+
+    if (sites->pending)
+        ret_sites_build(sites);
+
+    for (size_t i = 0; i < sites->count; i++)
+    {
+        struct site_bitmap *map = sites->segs[i].map;
+        for (size_t j = 0; map != NULL && j < map->len / sizeof(uint64_t); j++)
+            count += __builtin_popcountll(map->bits[j]);
+    }
+    return count;
+}
+
+/*
+ * Free a set of return sites.
+ */
+void ret_sites_free(struct ret_sites *sites)
+{
+    if (sites == NULL)
+        return;
+    for (size_t i = 0; i < sites->count; i++)
+    {
+        unref_bitmap(sites->segs[i].map);
+        free(sites->segs[i].file);
+    }
+    free(sites->segs);
+    free(sites);
+}
@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/seccomp.h>
+
+#define MAX_EPOLL_EVENTS 16
+
+/*
+ * A process supervised through a seccomp user notification fd.
+ */
+struct supervised_tracee
+{
+    pid_t pid;                        // Process that installed the filter.
+    int notify_fd;                    // Seccomp listener fd.
+};
+
+/*
+ * Serves any number of supervised tracees from one epoll(7) loop.
+ */
+struct supervisor
+{
+    int epoll_fd;                // Watches every tracee's notify fd.
+    int ntracees;                // Tracees still alive.
+    struct seccomp_notif *req;   // Sized for the running kernel.
+    struct seccomp_notif_resp *resp;
+    size_t req_size;
+    size_t resp_size;
+    bool attack_found;           // Set once any tracee was killed.
+    struct tracee_table tasks;   // Every task under a tracee's filter.
+    struct perf_collector_config *pptConf;
+};
+
+// Private prototypes.
+static bool send_fd(int, int);
+static int recv_fd(int);
+static struct tracee_thread *find_task(struct supervisor *, pid_t);
+static bool check_creator(struct supervisor *, pid_t, bool *, struct stats_config *);
+static bool handle_notification(struct supervisor *, struct supervised_tracee *,
+                                struct stats_config *);
+
+// Public prototypes.
+bool supervisor_init(struct supervisor *);
+struct supervised_tracee *supervisor_spawn(struct supervisor *, char **argv,
+                                           struct perf_collector_config *,
+                                           struct stats_config *);
+bool supervisor_loop(struct supervisor *, struct stats_config *);
+void supervisor_free(struct supervisor *);
+
+/*
+ * Pass file descriptor `fd' over the unix socket `sock'.
+ */
+static bool send_fd(int sock, int fd)
+{
+    char dummy = 0;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&dummy, sizeof(dummy)};
+    struct msghdr msg = {0};
+
+    memset(ctrl, 0, sizeof(ctrl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == sizeof(dummy);
+}
+
+/*
+ * Receive a file descriptor sent with send_fd().
+ *
+ * Returns the file descriptor, or -1 on error.
+ */
+static int recv_fd(int sock)
+{
+    char dummy;
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&dummy, sizeof(dummy)};
+    struct msghdr msg = {0};
+    int fd;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    if (recvmsg(sock, &msg, 0) != sizeof(dummy))
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/*
+ * Look up task `tid' among the traced ones. A task whose event reports it
+ * exited is dropped, its tid may have been reused since.
+ *
+ * Returns the task or NULL if it isn't traced.
+ */
+static struct tracee_thread *find_task(struct supervisor *sv, pid_t tid)
+{
+    struct tracee_thread *task = tracee_find(&sv->tasks, tid);
+    if (task == NULL)
+        return NULL;
+
+    struct pollfd pfd = {.fd = task->collector->perf_fd, .events = POLLIN};
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP))
+    {
+        tracee_remove(&sv->tasks, task);
+        return NULL;
+    }
+    return task;
+}
+
+/*
+ * Check the trace of every task of process `pid' up to now. One of them
+ * created the task whose first notification is pending, which ran untraced
+ * until then: the creator's trace is all there is to vouch for it. The
+ * tasks keep running, their events are turned off while their windows are
+ * taken. `found' says whether any task of `pid' is traced at all.
+ *
+ * Returns false if an attack was detected, true otherwise.
+ */
+static bool check_creator(struct supervisor *sv, pid_t pid, bool *found,
+                          struct stats_config *stats)
+{
+    bool safe = true;
+
+    *found = false;
+
+    for (int i = 0; i < sv->tasks.count; i++)
+    {
+        struct tracee_thread *task = sv->tasks.threads[i];
+        if (task->proc->pid != pid)
+            continue;
+        *found = true;
+        ioctl(task->collector->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (!check_window(task->collector, task->decoder, stats))
+            safe = false;
+        ioctl(task->collector->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return safe;
+}
+
+/*
+ * Set up an empty supervisor.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool supervisor_init(struct supervisor *sv)
+{
+    struct seccomp_notif_sizes sizes;
+
+    memset(sv, 0, sizeof(*sv));
+
+    // The notification structs may grow in newer kernels, so ask for the
+    // sizes rather than trusting our headers.
+    if (syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) == -1)
+    {
+        printf("Error: seccomp user notifications unsupported: %s\n", strerror(errno));
+        return false;
+    }
+    sv->req_size = sizes.seccomp_notif;
+    sv->resp_size = sizes.seccomp_notif_resp;
+    sv->req = malloc(sv->req_size);
+    sv->resp = malloc(sv->resp_size);
+    if (sv->req == NULL || sv->resp == NULL)
+    {
+        printf("Error: allocating notification buffers");
+        return false;
+    }
+
+    sv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sv->epoll_fd == -1)
+    {
+        printf("Error: creating epoll fd");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Fork and exec `argv' under a SECCOMP_RET_USER_NOTIF filter for the
+ * syscalls in `traced_syscalls', and add it to the supervisor.
+ *
+ * The child hands its listener fd back over a socketpair and waits until the
+ * PT collector is attached before it execs.
+ *
+ * Returns the new tracee, or NULL on error.
+ */
+struct supervised_tracee *
+supervisor_spawn(struct supervisor *sv, char **argv,
+                 struct perf_collector_config *pptConf, struct stats_config *stats)
+{
+    struct perf_ctx *collector = NULL;
+    struct inst_decoder_ctx *decoder = NULL;
+    int sock[2];
+    char go = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock) == -1)
+    {
+        printf("Error: creating socketpair");
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    switch (pid)
+    {
+    case -1: /* error */
+        printf("Error: fork: %s\n", strerror(errno));
+        return NULL;
+    case 0: /* child */
+    {
+        close(sock[0]);
+        int fd = install_syscall_filter(&traced_syscalls, SECCOMP_RET_USER_NOTIF,
+                                        SECCOMP_FILTER_FLAG_NEW_LISTENER);
+        if (fd == -1 || !send_fd(sock[1], fd))
+        {
+            fprintf(stderr, "seccomp: %s\n", strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        close(fd);
+        // Wait for the tracer to open the PT event on us.
+        if (read(sock[1], &go, 1) != 1)
+            _exit(EXIT_FAILURE);
+        execvp(argv[0], argv);
+        fprintf(stderr, "%s\n", strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    }
+
+    close(sock[1]);
+    sv->pptConf = pptConf;
+
+    struct supervised_tracee *t = malloc(sizeof(*t));
+    if (t == NULL)
+    {
+        printf("Error: allocating tracee");
+        goto fail;
+    }
+    memset(t, 0, sizeof(*t));
+    t->pid = pid;
+
+    t->notify_fd = recv_fd(sock[0]);
+    if (t->notify_fd == -1)
+    {
+        printf("Error: receiving notify fd");
+        goto fail;
+    }
+
+    // The child is waiting to exec, only trace the new image.
+    collector = perf_init_collector(pptConf, pid, true, stats);
+    if (collector == NULL)
+    {
+        printf("Collector error");
+        goto fail;
+    }
+
+    if (pptConf->filter != NULL &&
+        !apply_ip_filter(collector, argv[0], pptConf->filter))
+    {
+        printf("error: setting IP filter\n");
+        goto fail;
+    }
+
+    // The child still runs our image. It is about to exec, so its mappings
+    // are read again at the first notification: the new executable, its
+    // dynamic loader and, later, its shared libraries.
+    decoder = attach_inst_decoder(pid, NULL, stats);
+    if (decoder == NULL)
+    {
+        printf("error: decoder initialization\n");
+        goto fail;
+    }
+    watch_mappings(decoder, SYS_execve);
+
+    // Threads it starts share its image, see handle_notification().
+    if (tracee_insert(&sv->tasks, pid, collector, decoder) == NULL)
+        goto fail;
+    collector = NULL;
+    decoder = NULL;
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = t};
+    if (epoll_ctl(sv->epoll_fd, EPOLL_CTL_ADD, t->notify_fd, &ev) == -1)
+    {
+        printf("Error: watching notify fd");
+        goto fail;
+    }
+    sv->ntracees++;
+
+    // Let the child exec.
+    if (write(sock[0], &go, 1) != 1)
+    {
+        printf("Error: releasing tracee");
+        goto fail;
+    }
+    close(sock[0]);
+    return t;
+
+fail:
+    close(sock[0]);
+    free_insn_decoder(decoder);
+    if (collector != NULL)
+        perf_free_collector(collector);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return NULL;
+}
+
+/*
+ * Answer one pending notification of tracee `t'.
+ *
+ * The tracee is blocked inside the system call, so its trace is complete up
+ * to the syscall instruction. Benign calls are continued as if no filter was
+ * installed; on an attack the call fails and the process is killed.
+ *
+ * Threads and children inheriting the filter are adopted at their first
+ * notification, as tracee.c does for new tasks, and checked from then on:
+ * threads share the image of their process, children get a copy of their
+ * parent's. That first notification is only let through if the trace of
+ * the process that created the task shows no attack, see check_creator().
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool handle_notification(struct supervisor *sv, struct supervised_tracee *t,
+                                struct stats_config *stats)
+{
+    struct perf_ctx *collector = NULL;
+    struct inst_decoder_ctx *decoder = NULL;
+    pid_t victim = t->pid;
+    pid_t creator = 0;
+    bool safe = true;
+
+    memset(sv->req, 0, sv->req_size);
+    if (ioctl(t->notify_fd, SECCOMP_IOCTL_NOTIF_RECV, sv->req) == -1)
+    {
+        // The tracee was killed or the call interrupted, nothing to answer.
+        if (errno == ENOENT || errno == EINTR)
+            return true;
+        printf("Error: receiving notification: %s\n", strerror(errno));
+        return false;
+    }
+
+    pid_t tid = sv->req->pid;
+    struct tracee_thread *task = find_task(sv, tid);
+    if (task != NULL)
+    {
+        collector = task->collector;
+        decoder = task->decoder;
+        victim = task->proc->pid;
+    }
+    else
+    {
+        // A thread was created by its own process, a child by its parent.
+        pid_t tgid, ppid;
+        if (read_task_ids(tid, &tgid, &ppid))
+        {
+            creator = find_process(&sv->tasks, tgid) != NULL ? tgid : ppid;
+            victim = tgid;
+        }
+        // Blocked in the syscall, so its event starts right here.
+        if (tracee_adopt(&sv->tasks, tid, NULL, sv->pptConf, false, stats) == NULL)
+            printf("Error: tracing task %d\n", tid);
+    }
+
+    // Flush the PT buffer into the AUX area, snapshot ring included: the
+    // blocked tracee may not have been scheduled out yet.
+    if (collector != NULL)
+        ioctl(collector->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (stats->psyscall)
+        fprintf(stderr, "%d: %d(%lld, %lld, %lld, %lld, %lld, %lld)\n",
+                sv->req->pid, sv->req->data.nr,
+                (long long)sv->req->data.args[0], (long long)sv->req->data.args[1],
+                (long long)sv->req->data.args[2], (long long)sv->req->data.args[3],
+                (long long)sv->req->data.args[4], (long long)sv->req->data.args[5]);
+
+    if (collector != NULL)
+    {
+        safe = check_window(collector, decoder, stats);
+        watch_mappings(decoder, sv->req->data.nr);
+    }
+    else
+    {
+        bool found = false;
+        if (creator != 0 && !check_creator(sv, creator, &found, stats))
+        {
+            safe = false;
+            kill(creator, SIGKILL);
+        }
+        else if (!found)
+        {
+            printf("Task %d: no trace vouches for its first system call\n", tid);
+            safe = false;
+        }
+        // Its image follows from here, e.g. an execve.
+        task = find_task(sv, tid);
+        if (safe && task != NULL)
+            watch_mappings(task->decoder, sv->req->data.nr);
+    }
+
+    memset(sv->resp, 0, sv->resp_size);
+    sv->resp->id = sv->req->id;
+    if (safe)
+    {
+        sv->resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+    }
+    else
+    {
+        sv->resp->error = -EPERM;
+        sv->attack_found = true;
+        kill(victim, SIGKILL);
+    }
+
+    if (collector != NULL)
+        ioctl(collector->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+
+    if (ioctl(t->notify_fd, SECCOMP_IOCTL_NOTIF_SEND, sv->resp) == -1 &&
+        errno != ENOENT)
+    {
+        printf("Error: answering notification: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Serve notifications until every tracee has exited.
+ *
+ * Returns false if an attack was detected, true otherwise.
+ */
+bool supervisor_loop(struct supervisor *sv, struct stats_config *stats)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (sv->ntracees > 0)
+    {
+        int n = epoll_wait(sv->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("Error: epoll_wait: %s\n", strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct supervised_tracee *t = events[i].data.ptr;
+
+            if (events[i].events & EPOLLIN)
+                handle_notification(sv, t, stats);
+
+            // No process is using the filter anymore.
+            if (events[i].events & (EPOLLHUP | EPOLLERR))
+            {
+                epoll_ctl(sv->epoll_fd, EPOLL_CTL_DEL, t->notify_fd, NULL);
+                close(t->notify_fd);
+                waitpid(t->pid, NULL, 0);
+                if (stats->pinfo)
+                    for (int j = 0; j < sv->tasks.count; j++)
+                        perf_print_telemetry(sv->tasks.threads[j]->collector,
+                                             sv->tasks.threads[j]->tid);
+                free(t);
+                sv->ntracees--;
+            }
+        }
+    }
+    return !sv->attack_found;
+}
+
+/*
+ * Release the supervisor's own resources.
+ */
+void supervisor_free(struct supervisor *sv)
+{
+    if (sv->epoll_fd > 0)
+        close(sv->epoll_fd);
+    tracee_free_all(&sv->tasks);
+    free(sv->req);
+    free(sv->resp);
+}
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syscall.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#define MAX_FILTERED_SYSCALLS 64
+
+#ifndef __X32_SYSCALL_BIT
+#define __X32_SYSCALL_BIT 0x40000000
+#endif
+
+/*
+ * A set of system calls that stop the tracee for analysis.
+ */
+struct syscall_set
+{
+    long nrs[MAX_FILTERED_SYSCALLS]; // System call numbers.
+    int count;                       // Number of entries in `nrs'.
+};
+
+struct syscall_name
+{
+    const char *name;
+    long nr;
+};
+
+// System calls that can be named on the command line.
+static const struct syscall_name syscall_names[] = {
+    {"execve", SYS_execve},
+    {"execveat", SYS_execveat},
+    {"mprotect", SYS_mprotect},
+    {"pkey_mprotect", SYS_pkey_mprotect},
+    {"mmap", SYS_mmap},
+    {"munmap", SYS_munmap},
+    {"mremap", SYS_mremap},
+    {"rt_sigreturn", SYS_rt_sigreturn},
+    {"sigreturn", SYS_rt_sigreturn},
+    {"socket", SYS_socket},
+    {"connect", SYS_connect},
+    {"bind", SYS_bind},
+    {"listen", SYS_listen},
+    {"accept", SYS_accept},
+    {"accept4", SYS_accept4},
+    {"clone", SYS_clone},
+    {"fork", SYS_fork},
+    {"vfork", SYS_vfork},
+    {"ptrace", SYS_ptrace},
+    {"process_vm_writev", SYS_process_vm_writev},
+    {"open", SYS_open},
+    {"openat", SYS_openat},
+    {"dup2", SYS_dup2},
+    {"dup3", SYS_dup3},
+    {"setuid", SYS_setuid},
+    {"setgid", SYS_setgid},
+    {"setreuid", SYS_setreuid},
+    {"setresuid", SYS_setresuid},
+    {"chmod", SYS_chmod},
+    {"kill", SYS_kill},
+    {"exit_group", SYS_exit_group},
+    {NULL, 0}};
+
+// Used when no --syscalls list is given.
+static const char *default_syscalls =
+    "execve,execveat,mprotect,pkey_mprotect,mmap,munmap,mremap,rt_sigreturn,"
+    "socket,connect,bind,listen,accept,accept4,clone,fork,vfork,ptrace,"
+    "process_vm_writev";
+
+struct syscall_set traced_syscalls;
+
+// Public prototypes.
+bool parse_syscall_set(const char *list, struct syscall_set *set);
+bool syscall_in_set(const struct syscall_set *set, long nr);
+bool is_barrier_syscall(long nr, long prot);
+int install_syscall_filter(const struct syscall_set *set, unsigned int action,
+                           unsigned int flags);
+
+/*
+ * Parse a comma separated list of system call names or numbers into `set'.
+ * A NULL `list' selects the default set.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool parse_syscall_set(const char *list, struct syscall_set *set)
+{
+    char *copy, *tok, *save, *rest;
+
+    if (list == NULL)
+        list = default_syscalls;
+
+    copy = strdup(list);
+    if (copy == NULL)
+        return false;
+
+    set->count = 0;
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        long nr = -1;
+
+        for (const struct syscall_name *sn = syscall_names; sn->name; sn++)
+        {
+            if (strcmp(sn->name, tok) == 0)
+            {
+                nr = sn->nr;
+                break;
+            }
+        }
+        if (nr == -1)
+        {
+            errno = 0;
+            nr = strtol(tok, &rest, 0);
+            if (errno || *rest || nr < 0)
+            {
+                fprintf(stderr, "unknown system call: %s\n", tok);
+                free(copy);
+                return false;
+            }
+        }
+
+        if (syscall_in_set(set, nr))
+            continue;
+        if (set->count == MAX_FILTERED_SYSCALLS)
+        {
+            fprintf(stderr, "too many system calls, at most %d\n",
+                    MAX_FILTERED_SYSCALLS);
+            free(copy);
+            return false;
+        }
+        set->nrs[set->count++] = nr;
+    }
+
+    free(copy);
+    return true;
+}
+
+/*
+ * Is system call `nr' part of `set'?
+ */
+bool syscall_in_set(const struct syscall_set *set, long nr)
+{
+    for (int i = 0; i < set->count; i++)
+        if (set->nrs[i] == nr)
+            return true;
+    return false;
+}
+
+/*
+ * Must system call `nr' wait for all earlier trace to be analysed before it
+ * may run? These are the calls an attacker needs to turn control of the
+ * instruction stream into code execution or to leave the process. `prot' is
+ * the third argument, the protection of mmap/mprotect.
+ */
+bool is_barrier_syscall(long nr, long prot)
+{
+    switch (nr)
+    {
+    case SYS_execve:
+    case SYS_execveat:
+    case SYS_ptrace:
+    case SYS_process_vm_writev:
+    case SYS_rt_sigreturn:
+    case SYS_exit_group:
+        return true;
+    case SYS_mmap:
+    case SYS_mprotect:
+    case SYS_pkey_mprotect:
+        return (prot & PROT_EXEC) != 0;
+    }
+    return false;
+}
+
+/*
+ * Install a seccomp filter on the calling process that returns `action' for
+ * every system call in `set' and lets all other system calls through.
+ *
+ * Foreign architectures and the x32 ABI also get `action', so they can't be
+ * used to slip past the filter.
+ *
+ * Meant to be called in the child between fork(2) and execvp(3).
+ *
+ * Returns the result of seccomp(2): a listener fd when `flags' includes
+ * SECCOMP_FILTER_FLAG_NEW_LISTENER, 0 otherwise, or -1 on error.
+ */
+int install_syscall_filter(const struct syscall_set *set, unsigned int action,
+                           unsigned int flags)
+{
+    struct sock_filter filter[MAX_FILTERED_SYSCALLS + 8];
+    int len = 0;
+
+    // Check the architecture.
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                                 offsetof(struct seccomp_data, arch));
+    filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                 AUDIT_ARCH_X86_64, 1, 0);
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, action);
+
+    // Load the system call number and reject x32 calls.
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                                 offsetof(struct seccomp_data, nr));
+    filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+                                                 __X32_SYSCALL_BIT, 0, 1);
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, action);
+
+    // One comparison per system call, all jumping to the final `action'.
+    for (int i = 0; i < set->count; i++)
+        filter[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                     set->nrs[i], set->count - i, 0);
+
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    filter[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, action);
+
+    struct sock_fprog prog = {
+        .len = (unsigned short)len,
+        .filter = filter};
+
+    // Required to install a filter without CAP_SYS_ADMIN.
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1)
+        return -1;
+
+    return syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, flags, &prog);
+}
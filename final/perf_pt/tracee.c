@@ -0,0 +1,471 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+/*
+ * A traced process. Its threads share one decoder image.
+ */
+struct tracee_process
+{
+    pid_t pid;                            // Thread group id.
+    struct inst_decoder_ctx *image_owner; // Decoder whose image threads share.
+    int nthreads;                         // Threads still traced.
+};
+
+/*
+ * A traced thread, with its own PT stream and decoder state.
+ */
+struct tracee_thread
+{
+    pid_t tid;                        // Thread id, as reported by waitpid(2).
+    struct tracee_process *proc;      // Process the thread belongs to.
+    struct perf_ctx *collector;       // PT collector for this thread only.
+    struct inst_decoder_ctx *decoder; // Decoder state for this thread.
+    bool in_syscall;                  // Between syscall entry and exit stop?
+    bool fresh;                       // Initial SIGSTOP not seen yet.
+};
+
+/*
+ * All traced threads, across every process the tracee spawned.
+ */
+struct tracee_table
+{
+    struct tracee_thread **threads;         // Unordered, `count' entries.
+    int count;
+    int capacity;
+    struct pt_image_section_cache *iscache; // Shared by every process.
+} tracees;
+
+// Private prototypes.
+static struct tracee_process *find_process(struct tracee_table *, pid_t);
+static bool read_task_ids(pid_t, pid_t *, pid_t *);
+static bool read_exe(pid_t, char *, size_t);
+static struct inst_decoder_ctx *load_process_decoder(struct tracee_table *, pid_t,
+                                                     struct stats_config *);
+static bool filter_thread(struct tracee_thread *, struct perf_collector_config *);
+static bool grow_table(struct tracee_table *);
+
+// Public prototypes.
+struct tracee_thread *tracee_find(struct tracee_table *, pid_t);
+struct tracee_thread *tracee_adopt(struct tracee_table *, pid_t,
+                                   struct tracee_thread *,
+                                   struct perf_collector_config *, bool,
+                                   struct stats_config *);
+bool tracee_exec(struct tracee_table *, struct tracee_thread *, pid_t,
+                 struct perf_collector_config *, struct stats_config *);
+struct tracee_thread *tracee_insert(struct tracee_table *, pid_t, struct perf_ctx *,
+                                    struct inst_decoder_ctx *);
+void tracee_remove(struct tracee_table *, struct tracee_thread *);
+void tracee_free_all(struct tracee_table *);
+
+/*
+ * Read the thread group id and parent process id of task `tid'.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool read_task_ids(pid_t tid, pid_t *tgid, pid_t *ppid)
+{
+    char path[64], line[256];
+    FILE *status;
+
+    *tgid = *ppid = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", tid);
+    status = fopen(path, "r");
+    if (status == NULL)
+        return false;
+
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        sscanf(line, "Tgid: %d", tgid);
+        sscanf(line, "PPid: %d", ppid);
+    }
+    fclose(status);
+    return *tgid != -1 && *ppid != -1;
+}
+
+/*
+ * Resolve the executable of process `pid' into `buf'.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool read_exe(pid_t pid, char *buf, size_t len)
+{
+    char path[64];
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    n = readlink(path, buf, len - 1);
+    if (n == -1)
+        return false;
+    buf[n] = '\0';
+    return true;
+}
+
+/*
+ * Build a decoder with a fresh image of process `pid', which must be
+ * ptrace-stopped. Tracing starts at exec, with the dynamic loader, so the
+ * image comes from the process' mappings rather than just its executable.
+ *
+ * Returns a pointer to a decoder context or NULL on error.
+ */
+static struct inst_decoder_ctx *load_process_decoder(struct tracee_table *tab, pid_t pid,
+                                                     struct stats_config *stats)
+{
+    return attach_inst_decoder(pid, tab->iscache, stats);
+}
+
+/*
+ * Restrict the PT event of thread `t' to the objects in `pptConf->filter',
+ * if any, with "exe" being the current executable of its process.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool filter_thread(struct tracee_thread *t, struct perf_collector_config *pptConf)
+{
+    char exe[PATH_MAX];
+
+    if (pptConf->filter == NULL)
+        return true;
+
+    if (!read_exe(t->proc->pid, exe, sizeof(exe)))
+    {
+        printf("Error: reading executable of %d\n", t->proc->pid);
+        return false;
+    }
+    return apply_ip_filter(t->collector, exe, pptConf->filter);
+}
+
+/*
+ * Look up the traced process `pid', which may have lost its leader thread.
+ *
+ * Returns the process or NULL if it isn't traced.
+ */
+static struct tracee_process *find_process(struct tracee_table *tab, pid_t pid)
+{
+    for (int i = 0; i < tab->count; i++)
+        if (tab->threads[i]->proc->pid == pid)
+            return tab->threads[i]->proc;
+    return NULL;
+}
+
+/*
+ * Make room for one more thread in `tab'.
+ *
+ * Returns true on success or false otherwise.
+ */
+static bool grow_table(struct tracee_table *tab)
+{
+    if (tab->count < tab->capacity)
+        return true;
+
+    int new_capacity = tab->capacity ? tab->capacity * 2 : 16;
+    void *new_threads = realloc(tab->threads, new_capacity * sizeof(*tab->threads));
+    if (new_threads == NULL)
+    {
+        printf("Error: growing thread table");
+        return false;
+    }
+    tab->threads = new_threads;
+    tab->capacity = new_capacity;
+    return true;
+}
+
+/*
+ * Look up thread `tid'.
+ *
+ * Returns the thread or NULL if it isn't known yet.
+ */
+struct tracee_thread *tracee_find(struct tracee_table *tab, pid_t tid)
+{
+    for (int i = 0; i < tab->count; i++)
+        if (tab->threads[i]->tid == tid)
+            return tab->threads[i];
+    return NULL;
+}
+
+/*
+ * Start tracing task `tid': open a perf event with its own AUX mapping and
+ * set up a decoder.
+ *
+ * A new thread shares the image of its process. A new process forked from a
+ * traced one starts with a copy of its parent's image, and the call stack of
+ * `creator', the thread that forked it, if known; any other process gets a
+ * fresh image, see load_process_decoder().
+ *
+ * With `at_exec' the task is about to exec, and its event only starts with
+ * the new image. Its decoder stays without an image and its filter unset
+ * until then, see tracee_exec(). Otherwise it traces from the moment the
+ * task resumes.
+ *
+ * Returns the new thread or NULL on error.
+ */
+struct tracee_thread *tracee_adopt(struct tracee_table *tab, pid_t tid,
+                                   struct tracee_thread *creator,
+                                   struct perf_collector_config *pptConf,
+                                   bool at_exec, struct stats_config *stats)
+{
+    struct tracee_process *proc, *parent;
+    pid_t tgid, ppid;
+
+    if (!read_task_ids(tid, &tgid, &ppid))
+    {
+        printf("Error: reading ids of task %d\n", tid);
+        return NULL;
+    }
+
+    if (!grow_table(tab))
+        return NULL;
+
+    if (tab->iscache == NULL)
+    {
+        tab->iscache = pt_iscache_alloc(NULL);
+        if (tab->iscache == NULL)
+        {
+            printf("Error: allocating cache");
+            return NULL;
+        }
+    }
+
+    struct tracee_thread *t = malloc(sizeof(*t));
+    if (t == NULL)
+    {
+        printf("Error: allocating thread");
+        return NULL;
+    }
+    memset(t, 0, sizeof(*t));
+    t->tid = tid;
+
+    proc = find_process(tab, tgid);
+    if (proc != NULL)
+    {
+        // Another thread of a traced process.
+        t->proc = proc;
+        t->decoder = share_inst_decoder(proc->image_owner);
+    }
+    else
+    {
+        t->proc = malloc(sizeof(*t->proc));
+        if (t->proc == NULL)
+        {
+            printf("Error: allocating process");
+            free(t);
+            return NULL;
+        }
+        memset(t->proc, 0, sizeof(*t->proc));
+        t->proc->pid = tgid;
+
+        parent = find_process(tab, ppid);
+        if (parent != NULL)
+        {
+            struct inst_decoder_ctx *forker = NULL;
+            if (creator != NULL && creator->proc == parent)
+                forker = creator->decoder;
+            t->decoder = fork_inst_decoder(parent->image_owner, forker, tgid);
+        }
+        else if (at_exec)
+        {
+            // Nothing of the image before the exec is ever decoded.
+            t->decoder = alloc_inst_decoder(tab->iscache, stats);
+        }
+        else
+        {
+            t->decoder = load_process_decoder(tab, tgid, stats);
+        }
+        t->proc->image_owner = t->decoder;
+    }
+    if (t->decoder == NULL)
+    {
+        printf("error: decoder initialization\n");
+        if (t->proc->nthreads == 0)
+            free(t->proc);
+        free(t);
+        return NULL;
+    }
+
+    t->collector = perf_init_collector(pptConf, tid, at_exec, stats);
+    if (t->collector == NULL || (!at_exec && !filter_thread(t, pptConf)))
+    {
+        printf("Collector error");
+        if (t->collector != NULL)
+            perf_free_collector(t->collector);
+        free_insn_decoder(t->decoder);
+        if (t->proc->nthreads == 0)
+            free(t->proc);
+        free(t);
+        return NULL;
+    }
+
+    if (stats->pinfo)
+    {
+        printf("pid %d tid %d perf_fd %d\n", tgid, tid, t->collector->perf_fd);
+        printf("Aux Buffer size: %ld\n", t->collector->aux_bufsize);
+        printf("Base Buffer size: %ld\n", t->collector->base_bufsize);
+    }
+
+    t->proc->nthreads++;
+    tab->threads[tab->count++] = t;
+    return t;
+}
+
+/*
+ * Start tracing process `pid' through a collector and decoder the caller set
+ * up, as its first thread. The table owns them from then on, and threads
+ * adopted later share the decoder's image.
+ *
+ * Returns the new thread or NULL on error.
+ */
+struct tracee_thread *tracee_insert(struct tracee_table *tab, pid_t pid,
+                                    struct perf_ctx *collector,
+                                    struct inst_decoder_ctx *decoder)
+{
+    if (!grow_table(tab))
+        return NULL;
+
+    struct tracee_thread *t = malloc(sizeof(*t));
+    if (t != NULL)
+    {
+        memset(t, 0, sizeof(*t));
+        t->proc = malloc(sizeof(*t->proc));
+    }
+    if (t == NULL || t->proc == NULL)
+    {
+        printf("Error: allocating thread");
+        free(t);
+        return NULL;
+    }
+    memset(t->proc, 0, sizeof(*t->proc));
+    t->tid = pid;
+    t->proc->pid = pid;
+    t->proc->image_owner = t->decoder = decoder;
+    t->collector = collector;
+
+    t->proc->nthreads++;
+    tab->threads[tab->count++] = t;
+    return t;
+}
+
+/*
+ * Thread `t' completed an execve(2). `former' is the tid it had before, which
+ * differs from `t->tid' when a non-leader thread exec'd and took over the
+ * leader's tid.
+ *
+ * All other threads of the process are gone, and the decoder image and IP
+ * filter are rebuilt for the new executable. Sections of files that are still mapped
+ * come from the shared cache rather than being loaded again.
+ *
+ * Returns true on success or false otherwise.
+ */
+bool tracee_exec(struct tracee_table *tab, struct tracee_thread *t, pid_t former,
+                 struct perf_collector_config *pptConf, struct stats_config *stats)
+{
+    struct tracee_process *proc = t->proc;
+    pid_t tid = t->tid;
+
+    // The exec'ing thread keeps its perf event, so keep its entry and let it
+    // take over the leader's tid.
+    if (former != tid)
+    {
+        struct tracee_thread *execer = tracee_find(tab, former);
+        if (execer != NULL)
+        {
+            tracee_remove(tab, t);
+            t = execer;
+            t->tid = tid;
+        }
+    }
+
+    for (int i = 0; i < tab->count;)
+    {
+        if (tab->threads[i]->proc == proc && tab->threads[i] != t)
+            tracee_remove(tab, tab->threads[i]);
+        else
+            i++;
+    }
+
+    // Trace from before the exec belongs to the old image. A snapshot ring
+    // can't be released, so start over with a new one.
+    if (stats->snapshot)
+    {
+        perf_free_collector(t->collector);
+        t->collector = perf_init_collector(pptConf, t->tid, false, stats);
+        if (t->collector == NULL)
+        {
+            printf("Collector error");
+            return false;
+        }
+    }
+    else
+    {
+        void *window;
+        size_t window_len;
+        if (perf_next_window(t->collector, &window, &window_len))
+            perf_release_window(t->collector, window_len);
+        // So are its mappings, the new image comes from /proc.
+        perf_free_mmaps(t->collector->window_mmaps);
+        t->collector->window_mmaps = NULL;
+        t->collector->tail_dropped = false;
+    }
+
+    if (t->decoder != proc->image_owner)
+        free_insn_decoder(t->decoder);
+    free_insn_decoder(proc->image_owner);
+    t->decoder = proc->image_owner = NULL;
+
+    t->decoder = proc->image_owner = load_process_decoder(tab, proc->pid, stats);
+    if (t->decoder == NULL)
+        return false;
+
+    // The filter names the old executable.
+    return filter_thread(t, pptConf);
+}
+
+/*
+ * Stop tracing thread `t' and free it. The decoder owning the process image
+ * goes with the last thread of the process.
+ */
+void tracee_remove(struct tracee_table *tab, struct tracee_thread *t)
+{
+    struct tracee_process *proc = t->proc;
+
+    for (int i = 0; i < tab->count; i++)
+    {
+        if (tab->threads[i] == t)
+        {
+            tab->threads[i] = tab->threads[--tab->count];
+            break;
+        }
+    }
+
+    if (!perf_free_collector(t->collector))
+        printf("error: Freeing Tracer\n");
+    if (t->decoder != proc->image_owner)
+        free_insn_decoder(t->decoder);
+    free(t);
+
+    if (--proc->nthreads == 0)
+    {
+        free_insn_decoder(proc->image_owner);
+        free(proc);
+    }
+}
+
+/*
+ * Free every remaining thread and the shared section cache.
+ */
+void tracee_free_all(struct tracee_table *tab)
+{
+    while (tab->count > 0)
+        tracee_remove(tab, tab->threads[0]);
+    free(tab->threads);
+    tab->threads = NULL;
+    tab->capacity = 0;
+    if (tab->iscache != NULL)
+        pt_iscache_free(tab->iscache);
+    tab->iscache = NULL;
+}